@@ -0,0 +1,36 @@
+#!/bin/sh
+# Builds the table microbenchmark and clox from the working tree and from
+# another revision, then runs both on the same benchmarks.
+#
+# Usage: bench/compare.sh <git-ref>
+#
+# To compare against the table from before control bytes were added, pass
+# the parent of that commit. CC and CFLAGS override the compiler and flags.
+
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+ref=${1:?usage: bench/compare.sh <git-ref>}
+cc=${CC:-cc}
+cflags=${CFLAGS:--std=c2x -O2 -DNAN_BOXING}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mkdir -p "$work/old" "$work/new"
+git -C "$root" archive "$ref" src | tar -x -C "$work/old"
+cp -r "$root/src" "$work/new/"
+
+for tree in old new; do
+    sources=$(ls "$work/$tree"/src/*.c | grep -v '/main\.c$')
+    $cc $cflags -I"$work/$tree/src" $sources "$root/bench/table_bench.c" -lm -o "$work/$tree/table_bench"
+    $cc $cflags $sources "$work/$tree/src/main.c" -lm -o "$work/$tree/clox"
+done
+
+for tree in old new; do
+    echo "== $tree"
+    "$work/$tree/table_bench"
+    for script in globals fields methods; do
+        "$work/$tree/clox" "$root/bench/$script.lox" | tail -n 1
+    done
+done
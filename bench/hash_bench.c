@@ -0,0 +1,95 @@
+// Microbenchmark for string hashing. Build it with and without
+// STRING_HASH_FNV to compare the seeded hash against FNV-1a.
+//
+// It times the raw hash at several lengths, then lookups in a table whose
+// keys were picked so that their FNV-1a hashes share one home slot.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define COLLIDING_KEYS 3000
+#define SLOT_MASK (4095u << 7)
+
+static float64 now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (float64) time.tv_sec + (float64) time.tv_nsec * 1e-9;
+}
+
+static uint32 fnv_hash(const char* key, int32 length) {
+    uint32 hash = 2166136261u;
+    for (int32 i = 0; i < length; i++) {
+        hash ^= (uint8) key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void bench_hash(int32 length) {
+    char key[1024];
+    memset(key, 'a', sizeof(key));
+
+    uint64 iterations = 200000000 / (length + 16);
+    uint32 sum = 0;
+    float64 start = now();
+    for (uint64 i = 0; i < iterations; i++) {
+        // Changing the first byte stops the hash from being hoisted.
+        key[0] = (char) i;
+        sum += hash_string(key, length);
+    }
+    float64 elapsed = (now() - start) / iterations * 1e9;
+    printf("hash     length %4d  %7.2f ns  (%u)\n", length, elapsed, sum);
+}
+
+static void bench_collisions() {
+    static ObjString* keys[COLLIDING_KEYS];
+    Table table;
+    init_table(&table);
+
+    int32 count = 0;
+    char buffer[32];
+    for (uint32 i = 0; count < COLLIDING_KEYS; i++) {
+        int32 length = snprintf(buffer, sizeof(buffer), "key%u", i);
+        if ((fnv_hash(buffer, length) & SLOT_MASK) == 0) {
+            keys[count] = copy_string(buffer, length);
+            table_set(&table, keys[count], number_val(count));
+            count++;
+        }
+    }
+
+    uint64 iterations = 2000000;
+    Value value;
+    float64 sum = 0;
+    float64 start = now();
+    for (uint64 i = 0; i < iterations; i++) {
+        if (table_get(&table, keys[(i * 7919) % COLLIDING_KEYS], &value)) {
+            sum += as_number(value);
+        }
+    }
+    float64 elapsed = (now() - start) / iterations * 1e9;
+    printf("collide  %d keys  max probe %d  lookup %.2f ns  (%.0f)\n",
+           COLLIDING_KEYS, table_max_probe(&table), elapsed, sum);
+    free_table(&table);
+}
+
+int main() {
+    init_vm();
+    // The colliding keys are only reachable from a table the collector
+    // cannot see, so collection is turned off.
+    vm.next_gc = SIZE_MAX;
+
+    int32 lengths[] = { 4, 8, 16, 64, 256, 1024 };
+    for (int32 i = 0; i < (int32) (sizeof(lengths) / sizeof(lengths[0])); i++) {
+        bench_hash(lengths[i]);
+    }
+    bench_collisions();
+
+    free_vm();
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Microbenchmark for Table and string interning. It uses only the table and
+// string API, so bench/compare.sh can build it against an older tree.
+//
+// Table sizes are chosen to match how the VM uses tables: a handful of
+// instance fields, a class's methods, a program's globals, and large tables
+// at a spread of load factors.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEY_COUNT (1 << 18)
+#define ITERATIONS 20000000
+
+static ObjString* keys[KEY_COUNT];
+static ObjString* misses[KEY_COUNT];
+
+static float64 now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (float64) time.tv_sec + (float64) time.tv_nsec * 1e-9;
+}
+
+// Keys are visited in a scattered order so that lookups do not simply walk
+// the entry array.
+static int32 scatter(uint64 i, int32 count) {
+    return (int32) ((i * 7919) % count);
+}
+
+static void bench_table(const char* label, int32 count, uint64 iterations) {
+    Table table;
+    init_table(&table);
+    for (int32 i = 0; i < count; i++) {
+        table_set(&table, keys[i], number_val(i));
+    }
+
+    Value value;
+    float64 sum = 0;
+    float64 start = now();
+    for (uint64 i = 0; i < iterations; i++) {
+        if (table_get(&table, keys[scatter(i, count)], &value)) {
+            sum += as_number(value);
+        }
+    }
+    float64 hit = (now() - start) / iterations * 1e9;
+
+    start = now();
+    for (uint64 i = 0; i < iterations; i++) {
+        if (table_get(&table, misses[scatter(i, count)], &value)) {
+            sum += 1;
+        }
+    }
+    float64 miss = (now() - start) / iterations * 1e9;
+
+    uint64 rounds = iterations / count + 1;
+    start = now();
+    for (uint64 round = 0; round < rounds; round++) {
+        Table fresh;
+        init_table(&fresh);
+        for (int32 i = 0; i < count; i++) {
+            table_set(&fresh, keys[i], nil_val());
+        }
+        free_table(&fresh);
+    }
+    float64 insert = (now() - start) / (rounds * count) * 1e9;
+
+    // Prints the sum so the lookups cannot be optimized away.
+    printf("%-8s %7d keys  load %.2f  hit %6.2f ns  miss %6.2f ns  insert %6.2f ns  (%.0f)\n",
+           label, count, (float64) table.count / table.capacity, hit, miss, insert, sum);
+    free_table(&table);
+}
+
+// copy_string() looks a string up in the intern table before allocating,
+// so copying a string that already exists measures one intern lookup.
+static void bench_intern(int32 count, uint64 iterations) {
+    char buffer[32];
+    uint64 found = 0;
+    float64 start = now();
+    for (uint64 i = 0; i < iterations; i++) {
+        int32 length = snprintf(buffer, sizeof(buffer), "key%d", scatter(i, count));
+        found += copy_string(buffer, length) == keys[scatter(i, count)];
+    }
+    float64 lookup = (now() - start) / iterations * 1e9;
+    printf("intern   %7d keys  lookup %6.2f ns  (%llu)\n", count, lookup, (unsigned long long) found);
+}
+
+int main() {
+    init_vm();
+    // Everything is kept alive by the arrays above, which the collector
+    // cannot see, so collection is turned off.
+    vm.next_gc = SIZE_MAX;
+
+    char buffer[32];
+    for (int32 i = 0; i < KEY_COUNT; i++) {
+        int32 length = snprintf(buffer, sizeof(buffer), "key%d", i);
+        keys[i] = copy_string(buffer, length);
+        length = snprintf(buffer, sizeof(buffer), "miss%d", i);
+        misses[i] = copy_string(buffer, length);
+    }
+
+    bench_table("fields", 4, ITERATIONS);
+    bench_table("methods", 10, ITERATIONS);
+    bench_table("globals", 100, ITERATIONS);
+
+    // Powers of two times the load limit land just under and just over each
+    // resize, which covers the whole range of load factors.
+    int32 sizes[] = { 1000, 1400, 1600, 12000, 13000, 100000, 200000 };
+    for (int32 i = 0; i < (int32) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+        bench_table("large", sizes[i], ITERATIONS / 2);
+    }
+
+    int32 intern_counts[] = { 1000, 16000, KEY_COUNT };
+    for (int32 i = 0; i < (int32) (sizeof(intern_counts) / sizeof(intern_counts[0])); i++) {
+        bench_intern(intern_counts[i], ITERATIONS / 4);
+    }
+
+    free_vm();
+    return 0;
+}
@@ -0,0 +1,275 @@
+#include <string.h>
+
+#include "ast.h"
+
+Expr* new_expr(Arena* arena, ExprType type, int32 line) {
+    Expr* expr = ARENA_ALLOCATE(arena, Expr, 1);
+    expr->type = type;
+    expr->line = line;
+    return expr;
+}
+
+bool constant_is_falsey(const Constant* constant) {
+    return constant->type == ConstantNil || (constant->type == ConstantBool && !constant->as.boolean);
+}
+
+static bool constants_equal(const Constant* a, const Constant* b) {
+    if (a->type != b->type) {
+        return false;
+    }
+    switch (a->type) {
+        case ConstantNil: {
+            return true;
+        }
+        case ConstantBool: {
+            return a->as.boolean == b->as.boolean;
+        }
+        case ConstantNumber: {
+            return a->as.number == b->as.number;
+        }
+        case ConstantString: {
+            return a->as.string.length == b->as.string.length
+                && memcmp(a->as.string.chars, b->as.string.chars, a->as.string.length) == 0;
+        }
+        default: {
+            return false;  // Unreachable.
+        }
+    }
+}
+
+static void make_bool(Expr* expr, bool value) {
+    expr->type = ExprConstant;
+    expr->as.constant.type = ConstantBool;
+    expr->as.constant.as.boolean = value;
+}
+
+static void make_number(Expr* expr, float64 value) {
+    expr->type = ExprConstant;
+    expr->as.constant.type = ConstantNumber;
+    expr->as.constant.as.number = value;
+}
+
+static void fold_unary(Expr* expr) {
+    Constant* operand = &expr->as.unary.operand->as.constant;
+
+    switch (expr->as.unary.operator_type) {
+        case TokenBang: {
+            make_bool(expr, constant_is_falsey(operand));
+            break;
+        }
+        case TokenMinus: {
+            if (operand->type == ConstantNumber) {
+                make_number(expr, -operand->as.number);
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+static void concatenate(Arena* arena, Expr* expr, const Constant* a, const Constant* b) {
+    int32 length = a->as.string.length + b->as.string.length;
+    char* chars = ARENA_ALLOCATE(arena, char, length);
+    memcpy(chars, a->as.string.chars, a->as.string.length);
+    memcpy(chars + a->as.string.length, b->as.string.chars, b->as.string.length);
+
+    expr->type = ExprConstant;
+    expr->as.constant.type = ConstantString;
+    expr->as.constant.as.string.chars = chars;
+    expr->as.constant.as.string.length = length;
+}
+
+// Operations that would be a runtime error are left for the VM to report.
+// Comparisons are folded exactly as they are compiled, so `a >= b` is
+// `!(a < b)` and behaves the same for NaN.
+static void fold_binary(Arena* arena, Expr* expr) {
+    Constant* a = &expr->as.binary.left->as.constant;
+    Constant* b = &expr->as.binary.right->as.constant;
+    TokenType operator_type = expr->as.binary.operator_type;
+
+    if (operator_type == TokenEqualEqual || operator_type == TokenBangEqual) {
+        bool equal = constants_equal(a, b);
+        make_bool(expr, operator_type == TokenEqualEqual ? equal : !equal);
+        return;
+    }
+
+    if (operator_type == TokenPlus && a->type == ConstantString && b->type == ConstantString) {
+        concatenate(arena, expr, a, b);
+        return;
+    }
+
+    if (a->type != ConstantNumber || b->type != ConstantNumber) {
+        return;
+    }
+
+    float64 x = a->as.number;
+    float64 y = b->as.number;
+    switch (operator_type) {
+        case TokenGreater: {
+            make_bool(expr, x > y);
+            break;
+        }
+        case TokenGreaterEqual: {
+            make_bool(expr, !(x < y));
+            break;
+        }
+        case TokenLess: {
+            make_bool(expr, x < y);
+            break;
+        }
+        case TokenLessEqual: {
+            make_bool(expr, !(x > y));
+            break;
+        }
+        case TokenPlus: {
+            make_number(expr, x + y);
+            break;
+        }
+        case TokenMinus: {
+            make_number(expr, x - y);
+            break;
+        }
+        case TokenStar: {
+            make_number(expr, x * y);
+            break;
+        }
+        case TokenSlash: {
+            make_number(expr, x / y);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+static void fold_arguments(Arena* arena, Expr** arguments, uint8 arg_count) {
+    for (int32 i = 0; i < arg_count; i++) {
+        arguments[i] = fold_expr(arena, arguments[i]);
+    }
+}
+
+static bool is_constant(Expr* expr) {
+    return expr->type == ExprConstant;
+}
+
+// Folds constant subexpressions bottom-up. Nodes are rewritten in place,
+// except that a short-circuit with a constant left operand is replaced by
+// whichever operand it evaluates to.
+Expr* fold_expr(Arena* arena, Expr* expr) {
+    switch (expr->type) {
+        case ExprAssign: {
+            expr->as.assign.value = fold_expr(arena, expr->as.assign.value);
+            break;
+        }
+        case ExprUnary: {
+            expr->as.unary.operand = fold_expr(arena, expr->as.unary.operand);
+            if (is_constant(expr->as.unary.operand)) {
+                fold_unary(expr);
+            }
+            break;
+        }
+        case ExprBinary: {
+            expr->as.binary.left = fold_expr(arena, expr->as.binary.left);
+            expr->as.binary.right = fold_expr(arena, expr->as.binary.right);
+            if (is_constant(expr->as.binary.left) && is_constant(expr->as.binary.right)) {
+                fold_binary(arena, expr);
+            }
+            break;
+        }
+        case ExprLogical: {
+            Expr* left = fold_expr(arena, expr->as.binary.left);
+            Expr* right = fold_expr(arena, expr->as.binary.right);
+            if (is_constant(left)) {
+                bool falsey = constant_is_falsey(&left->as.constant);
+                if (expr->as.binary.operator_type == TokenAnd) {
+                    return falsey ? left : right;
+                }
+                return falsey ? right : left;
+            }
+            expr->as.binary.left = left;
+            expr->as.binary.right = right;
+            break;
+        }
+        case ExprCall: {
+            expr->as.call.callee = fold_expr(arena, expr->as.call.callee);
+            fold_arguments(arena, expr->as.call.arguments, expr->as.call.arg_count);
+            break;
+        }
+        case ExprGet: {
+            expr->as.property.object = fold_expr(arena, expr->as.property.object);
+            break;
+        }
+        case ExprSet: {
+            expr->as.property.object = fold_expr(arena, expr->as.property.object);
+            expr->as.property.value = fold_expr(arena, expr->as.property.value);
+            break;
+        }
+        case ExprInvoke: {
+            expr->as.property.object = fold_expr(arena, expr->as.property.object);
+            fold_arguments(arena, expr->as.property.arguments, expr->as.property.arg_count);
+            break;
+        }
+        case ExprSuper: {
+            if (expr->as.super.invoke) {
+                fold_arguments(arena, expr->as.super.arguments, expr->as.super.arg_count);
+            }
+            break;
+        }
+        case ExprInline: {
+            expr->as.inlined.call = fold_expr(arena, expr->as.inlined.call);
+            expr->as.inlined.body = fold_expr(arena, expr->as.inlined.body);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+    return expr;
+}
+
+// Copies a tree made of constants, variables, operators and property
+// reads, which is all an inlined function body may hold. Its only locals
+// are parameters, and given `arguments`, a read of slot n is replaced by
+// the n-th argument. String constants are copied too, since folded ones
+// live in the source arena.
+Expr* copy_expr(Arena* arena, Expr* expr, Expr** arguments) {
+    if (arguments != NULL && expr->type == ExprVariable && expr->as.variable.slot > 0) {
+        return arguments[expr->as.variable.slot - 1];
+    }
+
+    Expr* copy = new_expr(arena, expr->type, expr->line);
+    copy->as = expr->as;
+
+    switch (expr->type) {
+        case ExprConstant: {
+            if (expr->as.constant.type == ConstantString) {
+                int32 length = expr->as.constant.as.string.length;
+                char* chars = ARENA_ALLOCATE(arena, char, length);
+                memcpy(chars, expr->as.constant.as.string.chars, length);
+                copy->as.constant.as.string.chars = chars;
+            }
+            break;
+        }
+        case ExprUnary: {
+            copy->as.unary.operand = copy_expr(arena, expr->as.unary.operand, arguments);
+            break;
+        }
+        case ExprBinary:
+        case ExprLogical: {
+            copy->as.binary.left = copy_expr(arena, expr->as.binary.left, arguments);
+            copy->as.binary.right = copy_expr(arena, expr->as.binary.right, arguments);
+            break;
+        }
+        case ExprGet: {
+            copy->as.property.object = copy_expr(arena, expr->as.property.object, arguments);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+    return copy;
+}
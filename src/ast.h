@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.h"
+#include "memory.h"
+#include "scanner.h"
+
+// Expressions are parsed into a tree before any bytecode is emitted, so
+// the optimizer can look at a whole expression at once. The tree lives
+// in an arena and holds no heap objects: string literals point into the
+// source, and folded strings into the arena.
+typedef enum {
+    ConstantNil,
+    ConstantBool,
+    ConstantNumber,
+    ConstantString,
+} ConstantType;
+
+typedef struct {
+    ConstantType type;
+    union {
+        bool boolean;
+        float64 number;
+        struct {
+            const char* chars;
+            int32 length;
+        } string;
+    } as;
+} Constant;
+
+typedef enum {
+    ExprConstant,
+    ExprVariable,
+    ExprAssign,
+    ExprUnary,
+    ExprBinary,
+    ExprLogical,
+    ExprCall,
+    ExprGet,
+    ExprSet,
+    ExprInvoke,
+    ExprSuper,
+    ExprInline,
+} ExprType;
+
+typedef struct Expr Expr;
+
+// Locals and upvalues are resolved while parsing. A global has a `slot`
+// of -1 and is looked up by name.
+typedef struct {
+    Token name;
+    uint8 get_op;
+    uint8 set_op;
+    int32 slot;
+} Variable;
+
+struct Expr {
+    ExprType type;
+    int32 line;
+    union {
+        Constant constant;
+        Variable variable;
+        struct {
+            Variable variable;
+            Expr* value;
+        } assign;
+        struct {
+            TokenType operator_type;
+            Expr* operand;
+        } unary;
+        struct {
+            TokenType operator_type;
+            Expr* left;
+            Expr* right;
+        } binary;
+        struct {
+            Expr* callee;
+            Expr** arguments;
+            uint8 arg_count;
+        } call;
+        struct {
+            Expr* object;
+            Token name;
+            Expr* value;
+            Expr** arguments;
+            uint8 arg_count;
+        } property;
+        struct {
+            Token name;
+            Expr* receiver;
+            Expr* superclass;
+            bool invoke;
+            Expr** arguments;
+            uint8 arg_count;
+        } super;
+        // A call whose callee body has been spliced in, kept for the
+        // fallback path. `candidate` identifies the callee to the compiler.
+        struct {
+            Expr* call;
+            Expr* body;
+            int32 candidate;
+        } inlined;
+    } as;
+};
+
+Expr* new_expr(Arena* arena, ExprType type, int32 line);
+bool constant_is_falsey(const Constant* constant);
+Expr* fold_expr(Arena* arena, Expr* expr);
+Expr* copy_expr(Arena* arena, Expr* expr, Expr** arguments);
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -10,21 +11,27 @@ void init_chunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->inline_sites = NULL;
+    chunk->inline_count = 0;
+    chunk->inline_capacity = 0;
 }
 
 void free_chunk(Chunk* chunk) {
     FREE_ARRAY(uint8, chunk->code, chunk->capacity);
     FREE_ARRAY(int32, chunk->lines, chunk->capacity);
+    FREE_ARRAY(InlineSite, chunk->inline_sites, chunk->inline_capacity);
     free_value_array(&chunk->constants);
     init_chunk(chunk);
 }
 
-void write_chunk(Chunk* chunk, uint8 byte, int32 line) {
+// While a function is being compiled its arrays live in the compiler's
+// arena, see finish_chunk().
+void write_chunk(Chunk* chunk, Arena* arena, uint8 byte, int32 line) {
     if (chunk->capacity < chunk->count + 1) {
         int32 old_capacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8, chunk->code, old_capacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int32, chunk->lines, old_capacity, chunk->capacity);
+        chunk->code = ARENA_GROW_ARRAY(arena, uint8, chunk->code, old_capacity, chunk->capacity);
+        chunk->lines = ARENA_GROW_ARRAY(arena, int32, chunk->lines, old_capacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
@@ -32,9 +39,51 @@ void write_chunk(Chunk* chunk, uint8 byte, int32 line) {
     chunk->count++;
 }
 
-int32 add_constant(Chunk* chunk, Value value) {
-    push(value);
-    write_value_array(&chunk->constants, value);
-    pop();
-    return chunk->constants.count - 1;
+int32 add_constant(Chunk* chunk, Arena* arena, Value value) {
+    ValueArray* constants = &chunk->constants;
+    if (constants->capacity < constants->count + 1) {
+        int32 old_capacity = constants->capacity;
+        constants->capacity = GROW_CAPACITY(old_capacity);
+        constants->values = ARENA_GROW_ARRAY(arena, Value, constants->values, old_capacity, constants->capacity);
+    }
+
+    constants->values[constants->count] = value;
+    return constants->count++;
+}
+
+void add_inline_site(Chunk* chunk, Arena* arena, InlineSite site) {
+    if (chunk->inline_capacity < chunk->inline_count + 1) {
+        int32 old_capacity = chunk->inline_capacity;
+        chunk->inline_capacity = GROW_CAPACITY(old_capacity);
+        chunk->inline_sites = ARENA_GROW_ARRAY(arena, InlineSite, chunk->inline_sites, old_capacity, chunk->inline_capacity);
+    }
+    chunk->inline_sites[chunk->inline_count++] = site;
+}
+
+// Moves the arena-backed arrays into exactly sized heap arrays.
+void finish_chunk(Chunk* chunk) {
+    uint8* code = ALLOCATE(uint8, chunk->count);
+    int32* lines = ALLOCATE(int32, chunk->count);
+    Value* values = ALLOCATE(Value, chunk->constants.count);
+
+    memcpy(code, chunk->code, sizeof(uint8) * chunk->count);
+    memcpy(lines, chunk->lines, sizeof(int32) * chunk->count);
+    if (chunk->constants.count != 0) {
+        memcpy(values, chunk->constants.values, sizeof(Value) * chunk->constants.count);
+    }
+
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->capacity = chunk->count;
+    chunk->constants.values = values;
+    chunk->constants.capacity = chunk->constants.count;
+
+    if (chunk->inline_count != 0) {
+        InlineSite* sites = ALLOCATE(InlineSite, chunk->inline_count);
+        memcpy(sites, chunk->inline_sites, sizeof(InlineSite) * chunk->inline_count);
+        chunk->inline_sites = sites;
+    } else {
+        chunk->inline_sites = NULL;
+    }
+    chunk->inline_capacity = chunk->inline_count;
 }
@@ -14,26 +14,44 @@ typedef enum {
     OpGetGlobal,
     OpDefineGlobal,
     OpSetGlobal,
+    OpHoistGlobal,
+    OpGetHoisted,
     OpGetUpvalue,
     OpSetUpvalue,
+    OpGetCopied,
     OpGetProperty,
     OpSetProperty,
     OpGetSuper,
     OpEqual,
+    OpNotEqual,
     OpGreater,
+    OpGreaterEqual,
     OpLess,
+    OpLessEqual,
     OpAdd,
     OpSubtract,
     OpMultiply,
     OpDivide,
+    OpAddNumber,
+    OpSubtractNumber,
+    OpMultiplyNumber,
+    OpDivideNumber,
     OpNot,
     OpNegate,
+    OpNegateNumber,
     OpPrint,
     OpJump,
     OpJumpIfFalse,
+    OpJumpIfNotLess,
+    OpJumpIfNotGreater,
+    OpJumpIfNotEqual,
     OpLoop,
+    OpForLoop,
     OpCall,
+    OpTailCall,
+    OpInlineGuard,
     OpInvoke,
+    OpTailInvoke,
     OpSuperInvoke,
     OpClosure,
     OpCloseUpvalue,
@@ -43,15 +61,41 @@ typedef enum {
     OpMethod,
 } OpCode;
 
+// How OpForLoop compares its counter with the bound. ForLocalBound is set
+// when the bound is a local slot rather than a constant.
+typedef enum {
+    ForLess,
+    ForLessEqual,
+    ForGreater,
+    ForGreaterEqual,
+    ForLocalBound = 4,
+} ForLoopMode;
+
+typedef struct Arena Arena;
+
+// Code spliced in from the function `name`. An error in [start, end) is
+// reported as if that function had been called from `line`.
+typedef struct {
+    int32 start;
+    int32 end;
+    int32 line;
+    ObjString* name;
+} InlineSite;
+
 typedef struct {
     int32 count;
     int32 capacity;
     uint8* code;
     int32* lines;
     ValueArray constants;
+    InlineSite* inline_sites;
+    int32 inline_count;
+    int32 inline_capacity;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
-void write_chunk(Chunk* chunk, uint8 byte, int32 line);
-int32 add_constant(Chunk* chunk, Value value);
+void write_chunk(Chunk* chunk, Arena* arena, uint8 byte, int32 line);
+int32 add_constant(Chunk* chunk, Arena* arena, Value value);
+void add_inline_site(Chunk* chunk, Arena* arena, InlineSite site);
+void finish_chunk(Chunk* chunk);
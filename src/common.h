@@ -9,6 +9,8 @@
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define STRING_HASH_FNV
+// #define STRING_EAGER_INTERN
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 typedef uint8_t uint8;
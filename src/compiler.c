@@ -2,16 +2,27 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "ast.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+#define HOIST_MAX 16
+#define HOIST_SCAN_MAX 256
+#define ASSIGNED_SLOTS 1024
+#define NEST_MAX 64
+#define INLINE_MAX 64
+#define INLINE_NODES_MAX 16
+#define LIFT_MAX 16
+#define TYPED_MAX 64
+
 typedef struct {
     Token current;
     Token previous;
@@ -33,11 +44,12 @@ typedef enum {
     PrecPrimary,
 } Precedence;
 
-typedef void (*ParseFn)(bool);
+typedef Expr* (*PrefixFn)(bool);
+typedef Expr* (*InfixFn)(Expr*, bool);
 
 typedef struct {
-    ParseFn prefix;
-    ParseFn infix;
+    PrefixFn prefix;
+    InfixFn infix;
     Precedence precedence;
 } ParseRule;
 
@@ -45,6 +57,10 @@ typedef struct {
     Token name;
     int32 depth;
     bool is_captured;
+    bool is_written;
+    Variable* lifted;  // Passed after the arguments of every call to it.
+    int32 lifted_count;
+    int32 type_id;  // Set when only numbers were stored so far.
 } Local;
 
 typedef struct {
@@ -52,6 +68,20 @@ typedef struct {
     bool is_local;
 } Upvalue;
 
+// A global read inside a loop that is loaded once before the loop, into
+// a hidden local at `slot`.
+typedef struct {
+    Token name;
+    uint8 slot;
+} Hoisted;
+
+// An arithmetic instruction emitted without its type check. `deps` has a
+// bit for each typed local that was relied on to hold a number.
+typedef struct {
+    int32 offset;
+    uint64 deps;
+} ElidedCheck;
+
 typedef enum {
     TypeFunction,
     TypeInitializer,
@@ -61,12 +91,25 @@ typedef enum {
 
 typedef struct Compiler {
     struct Compiler* enclosing;
+    ArenaMark arena_mark;
     ObjFunction* function;
     FunctionType type;
     Local locals[UINT8_COUNT];
     int32 local_count;
     Upvalue upvalues[UINT8_COUNT];
+    Upvalue copied[UINT8_COUNT];
     int32 scope_depth;
+    bool unreachable;
+    Hoisted hoisted[HOIST_MAX];
+    int32 hoisted_count;
+    bool capture_return;
+    Expr* returned;
+    uint64 number_deps[TYPED_MAX];
+    uint64 not_number;
+    int32 typed_count;
+    ElidedCheck* elided;
+    int32 elided_count;
+    int32 elided_capacity;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -74,9 +117,46 @@ typedef struct ClassCompiler {
     bool has_superclass;
 } ClassCompiler;
 
+typedef enum {
+    ConditionUnknown,
+    ConditionTrue,
+    ConditionFalse,
+} Condition;
+
+typedef struct {
+    uint8 counter;
+    uint8 mode;
+    float64 step;
+    Expr* bound;
+    int32 line;
+} CountedLoop;
+
 Parser parser;
 Compiler* current = NULL;
 ClassCompiler* current_class = NULL;
+Arena compiler_arena;
+Arena ast_arena;
+
+// For every name that appears as an assignment target in code compiled so
+// far, one more than the deepest function nesting at which it does, with
+// names hashed into a fixed table. Globals are only defined by top-level
+// statements, so while a loop runs, a global that is never assigned can't
+// change. That holds for a whole program, but not for a REPL line, since a
+// function defined on a later line may assign any global.
+static uint8 assigned_depth[ASSIGNED_SLOTS];
+
+// A top-level function whose body is `return` of a small expression with
+// no calls or assignments. When optimizing, later calls to it are
+// replaced by a copy of that expression, guarded by a check that the
+// callee is still this function.
+typedef struct {
+    ObjFunction* function;
+    Expr* body;
+} InlineCandidate;
+
+static InlineCandidate inline_candidates[INLINE_MAX];
+static int32 inline_count;
+Arena inline_arena;
 
 static Chunk* current_chunk() {
     return &current->function->chunk;
@@ -142,8 +222,13 @@ static bool match(TokenType type) {
     return true;
 }
 
+// Code that can never run, such as the rest of a block after `return`,
+// is parsed and checked as usual but not emitted.
 static void emit_byte(uint8 byte) {
-    write_chunk(current_chunk(), byte, parser.previous.line);
+    if (current->unreachable) {
+        return;
+    }
+    write_chunk(current_chunk(), &compiler_arena, byte, parser.previous.line);
 }
 
 static void emit_bytes(uint8 byte1, uint8 byte2) {
@@ -152,6 +237,9 @@ static void emit_bytes(uint8 byte1, uint8 byte2) {
 }
 
 static void emit_loop(int32 loop_start) {
+    if (current->unreachable) {
+        return;
+    }
     emit_byte(OpLoop);
 
     int32 offset = current_chunk()->count - loop_start + 2;
@@ -164,6 +252,9 @@ static void emit_loop(int32 loop_start) {
 }
 
 static int32 emit_jump(uint8 instruction) {
+    if (current->unreachable) {
+        return -1;
+    }
     emit_byte(instruction);
     emit_byte(0xff);
     emit_byte(0xff);
@@ -180,7 +271,10 @@ static void emit_return() {
 }
 
 static uint8 make_constant(Value value) {
-    int32 constant = add_constant(current_chunk(), value);
+    if (current->unreachable) {
+        return 0;
+    }
+    int32 constant = add_constant(current_chunk(), &compiler_arena, value);
     if (constant > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -193,6 +287,9 @@ static void emit_constant(Value value) {
 }
 
 static void patch_jump(int32 offset) {
+    if (offset == -1) {
+        return;
+    }
     int32 jump = current_chunk()->count - offset - 2;
 
     if (jump > UINT16_MAX) {
@@ -201,14 +298,27 @@ static void patch_jump(int32 offset) {
 
     current_chunk()->code[offset] = (jump >> 8) & 0xff;
     current_chunk()->code[offset + 1] = jump & 0xff;
+    current->unreachable = false;
 }
 
-static void init_compiler(Compiler* compiler, FunctionType type) {
+static void init_compiler(FunctionType type) {
+    ArenaMark mark = arena_mark(&compiler_arena);
+    Compiler* compiler = ARENA_ALLOCATE(&compiler_arena, Compiler, 1);
+    compiler->arena_mark = mark;
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
     compiler->scope_depth = 0;
+    compiler->unreachable = current != NULL && current->unreachable;
+    compiler->hoisted_count = 0;
+    compiler->capture_return = false;
+    compiler->returned = NULL;
+    compiler->not_number = 0;
+    compiler->typed_count = 0;
+    compiler->elided = NULL;
+    compiler->elided_count = 0;
+    compiler->elided_capacity = 0;
     compiler->function = new_function();
     current = compiler;
     if (type != TypeScript) {
@@ -218,6 +328,10 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
     Local* local = &current->locals[current->local_count++];
     local->depth = 0;
     local->is_captured = false;
+    local->is_written = false;
+    local->lifted = NULL;
+    local->lifted_count = 0;
+    local->type_id = -1;
     if (type != TypeFunction) {
         local->name.start = "this";
         local->name.length = 4;
@@ -227,17 +341,92 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+// A method that is exactly `return this.field;` is marked so the VM can
+// read the field without calling it.
+static void find_getter(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    if (function->arity == 0 && chunk->count == 5
+        && chunk->code[0] == OpGetLocal && chunk->code[1] == 0
+        && chunk->code[2] == OpGetProperty && chunk->code[4] == OpReturn) {
+        function->getter = as_string(chunk->constants.values[chunk->code[3]]);
+    }
+}
+
+static uint8 checked_op(uint8 op) {
+    switch (op) {
+        case OpAddNumber: {
+            return OpAdd;
+        }
+        case OpSubtractNumber: {
+            return OpSubtract;
+        }
+        case OpMultiplyNumber: {
+            return OpMultiply;
+        }
+        case OpDivideNumber: {
+            return OpDivide;
+        }
+        case OpNegateNumber: {
+            return OpNegate;
+        }
+        default: {
+            return op;
+        }
+    }
+}
+
+// Called when a typed local may hold something other than a number. Any
+// local that was typed from it is forgotten as well, and every check that
+// was elided on their account is put back.
+static void forget_number(Compiler* compiler, int32 type_id) {
+    uint64 forgotten = compiler->not_number | ((uint64) 1 << type_id);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int32 i = 0; i < compiler->typed_count; i++) {
+            uint64 bit = (uint64) 1 << i;
+            if ((forgotten & bit) == 0 && (compiler->number_deps[i] & forgotten) != 0) {
+                forgotten |= bit;
+                changed = true;
+            }
+        }
+    }
+    compiler->not_number = forgotten;
+
+    Chunk* chunk = &compiler->function->chunk;
+    int32 kept = 0;
+    for (int32 i = 0; i < compiler->elided_count; i++) {
+        ElidedCheck* check = &compiler->elided[i];
+        if ((check->deps & forgotten) != 0) {
+            chunk->code[check->offset] = checked_op(chunk->code[check->offset]);
+        } else {
+            compiler->elided[kept++] = *check;
+        }
+    }
+    compiler->elided_count = kept;
+}
+
 static ObjFunction* end_compiler() {
     emit_return();
     ObjFunction* function = current->function;
+    optimize_chunk(&function->chunk, &compiler_arena);
+    if (current->type == TypeMethod) {
+        find_getter(function);
+    }
+    finish_chunk(&function->chunk);
 
     #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
         disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        if (current->elided_count > 0) {
+            printf("-- %d type checks elided\n", current->elided_count);
+        }
     }
     #endif
 
+    ArenaMark mark = current->arena_mark;
     current = current->enclosing;
+    arena_release(&compiler_arena, mark);
     return function;
 }
 
@@ -262,7 +451,7 @@ static void expression();
 static void statement();
 static void declaration();
 static ParseRule* get_rule(TokenType type);
-static void parse_precedence(Precedence precedence);
+static Expr* parse_precedence(Precedence precedence);
 
 static uint8 identifier_constant(Token* name) {
     return make_constant(obj_val((Obj*) copy_string(name->start, name->length)));
@@ -288,40 +477,80 @@ static int32 resolve_local(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static int32 add_upvalue(Compiler* compiler, uint8 index, bool is_local) {
-    int32 upvalue_count = compiler->function->upvalue_count;
+static uint32 name_hash(Token* name) {
+    uint32 hash = 2166136261u;
+    for (int32 i = 0; i < name->length; i++) {
+        hash ^= (uint8) name->start[i];
+        hash *= 16777619;
+    }
+    return hash % ASSIGNED_SLOTS;
+}
+
+static void mark_assigned(Token* name, int32 depth) {
+    uint8* slot = &assigned_depth[name_hash(name)];
+    if (depth + 1 > *slot) {
+        *slot = (uint8) (depth + 1 < UINT8_MAX ? depth + 1 : UINT8_MAX);
+    }
+}
+
+static bool is_assigned(Token* name) {
+    return assigned_depth[name_hash(name)] != 0;
+}
+
+// Whether code in a function nested deeper than `depth` may assign a
+// variable called `name`.
+static bool is_assigned_below(Token* name, int32 depth) {
+    return assigned_depth[name_hash(name)] > depth + 1;
+}
+
+// A captured variable that is never assigned is copied into the closure
+// when it is created, instead of being boxed in an upvalue. Copies and
+// upvalues are numbered separately.
+static int32 add_upvalue(Compiler* compiler, uint8 index, bool is_local, bool is_copied) {
+    Upvalue* upvalues = is_copied ? compiler->copied : compiler->upvalues;
+    int32* upvalue_count = is_copied ? &compiler->function->copied_count : &compiler->function->upvalue_count;
 
-    for (int32 i = 0; i < upvalue_count; i++) {
-        Upvalue* upvalue = &compiler->upvalues[i];
+    for (int32 i = 0; i < *upvalue_count; i++) {
+        Upvalue* upvalue = &upvalues[i];
         if (upvalue->index == index && upvalue->is_local == is_local) {
             return i;
         }
     }
 
-    if (upvalue_count == UINT8_COUNT) {
+    if (*upvalue_count == UINT8_COUNT) {
         error("Too many closure variables in function.");
         return 0;
     }
 
-    compiler->upvalues[upvalue_count].is_local = is_local;
-    compiler->upvalues[upvalue_count].index = index;
-    return compiler->function->upvalue_count++;
+    upvalues[*upvalue_count].is_local = is_local;
+    upvalues[*upvalue_count].index = index;
+    return (*upvalue_count)++;
 }
 
-static int32 resolve_upvalue(Compiler* compiler, Token* name) {
+// Whether the variable was copied is the same all along the chain, since
+// it only depends on the name.
+static int32 resolve_upvalue(Compiler* compiler, Token* name, bool* is_copied) {
     if (compiler->enclosing == NULL) {
         return -1;
     }
 
     int32 local = resolve_local(compiler->enclosing, name);
     if (local != -1) {
-        compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8) local, true);
+        *is_copied = vm.optimize && !is_assigned(name);
+        if (!*is_copied) {
+            // The closure may store anything in it.
+            Local* captured = &compiler->enclosing->locals[local];
+            captured->is_captured = true;
+            if (captured->type_id != -1) {
+                forget_number(compiler->enclosing, captured->type_id);
+            }
+        }
+        return add_upvalue(compiler, (uint8) local, true, *is_copied);
     }
 
-    int32 upvalue = resolve_upvalue(compiler->enclosing, name);
+    int32 upvalue = resolve_upvalue(compiler->enclosing, name, is_copied);
     if (upvalue != -1) {
-        return add_upvalue(compiler, (uint8) upvalue, false);
+        return add_upvalue(compiler, (uint8) upvalue, false, *is_copied);
     }
 
     return -1;
@@ -337,6 +566,10 @@ static void add_local(Token name) {
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
+    local->is_written = false;
+    local->lifted = NULL;
+    local->lifted_count = 0;
+    local->type_id = -1;
 }
 
 static void declare_variable() {
@@ -377,6 +610,228 @@ static void mark_initialized() {
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
+// Follows the nesting of blocks while the tokens ahead of the parser are
+// scanned. The block right after `fun` is a function body, and so is any
+// block directly inside a class body.
+typedef enum {
+    BlockPlain,
+    BlockFunction,
+    BlockClass,
+} BlockKind;
+
+typedef struct {
+    uint8 kinds[NEST_MAX];
+    int32 depth;
+    int32 function_depth;
+    bool after_fun;
+    bool after_class;
+} Nesting;
+
+static void init_nesting(Nesting* nesting) {
+    nesting->depth = 0;
+    nesting->function_depth = 0;
+    nesting->after_fun = false;
+    nesting->after_class = false;
+}
+
+static void track_nesting(Nesting* nesting, Token* token) {
+    switch (token->type) {
+        case TokenFun: {
+            nesting->after_fun = true;
+            break;
+        }
+        case TokenClass: {
+            nesting->after_class = true;
+            break;
+        }
+        case TokenLeftBrace: {
+            bool in_class = nesting->depth > 0 && nesting->depth <= NEST_MAX
+                && nesting->kinds[nesting->depth - 1] == BlockClass;
+            BlockKind kind = BlockPlain;
+            if (nesting->after_fun || in_class) {
+                kind = BlockFunction;
+                nesting->function_depth++;
+            } else if (nesting->after_class) {
+                kind = BlockClass;
+            }
+            if (nesting->depth < NEST_MAX) {
+                nesting->kinds[nesting->depth] = (uint8) kind;
+            }
+            nesting->depth++;
+            nesting->after_fun = false;
+            nesting->after_class = false;
+            break;
+        }
+        case TokenRightBrace: {
+            if (nesting->depth == 0) {
+                break;
+            }
+            nesting->depth--;
+            if (nesting->depth < NEST_MAX && nesting->kinds[nesting->depth] == BlockFunction) {
+                nesting->function_depth--;
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+// Initializers of `var` declarations don't count: globals are only
+// declared at the top level, never while a loop runs.
+static void scan_assignments(const char* source) {
+    init_scanner(source);
+    Nesting nesting;
+    init_nesting(&nesting);
+    TokenType before = TokenEOF;
+    Token previous = scan_token();
+    while (previous.type != TokenEOF) {
+        track_nesting(&nesting, &previous);
+        Token token = scan_token();
+        if (previous.type == TokenIdentifier && token.type == TokenEqual && before != TokenVar) {
+            mark_assigned(&previous, nesting.function_depth);
+        }
+        before = previous.type;
+        previous = token;
+    }
+}
+
+static int32 resolve_hoisted(Compiler* compiler, Token* name) {
+    for (int32 i = compiler->hoisted_count - 1; i >= 0; i--) {
+        if (identifiers_equal(name, &compiler->hoisted[i].name)) {
+            return compiler->hoisted[i].slot;
+        }
+    }
+    return -1;
+}
+
+
+static bool contains_local(Compiler* compiler, Token* name) {
+    for (int32 i = 0; i < compiler->local_count; i++) {
+        if (identifiers_equal(name, &compiler->locals[i].name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_visible_local(Token* name) {
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        if (contains_local(compiler, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool contains_name(Token* names, int32 count, Token* name) {
+    for (int32 i = 0; i < count; i++) {
+        if (identifiers_equal(&names[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Scans ahead over a loop's header and block body for the globals it
+// reads. `depth` is the number of header parentheses already open.
+// Returns false if the body is not a block.
+static bool scan_loop_reads(int32 depth, Token* reads, int32* read_count) {
+    Token declared[HOIST_SCAN_MAX];
+    int32 declared_count = 0;
+    int32 count = 0;
+
+    Scanner saved = save_scanner();
+    Token previous = parser.previous;
+    Token token = parser.current;
+    bool in_body = false;
+    bool complete = false;
+
+    while (token.type != TokenEOF && !complete) {
+        if (token.type == TokenIdentifier) {
+            if (previous.type == TokenVar || previous.type == TokenFun || previous.type == TokenClass) {
+                if (declared_count < HOIST_SCAN_MAX) {
+                    declared[declared_count++] = token;
+                }
+            } else if (previous.type != TokenDot && count < HOIST_SCAN_MAX && !contains_name(reads, count, &token)) {
+                reads[count++] = token;
+            }
+        }
+
+        if (!in_body) {
+            if (token.type == TokenLeftParen) {
+                depth++;
+            } else if (token.type == TokenRightParen && --depth == 0) {
+                previous = token;
+                token = scan_token();
+                if (token.type != TokenLeftBrace) {
+                    break;
+                }
+                in_body = true;
+            }
+        }
+        if (in_body) {
+            if (token.type == TokenLeftBrace) {
+                depth++;
+            } else if (token.type == TokenRightBrace && --depth == 0) {
+                complete = true;
+            }
+        }
+
+        previous = token;
+        token = scan_token();
+    }
+    restore_scanner(saved);
+
+    *read_count = 0;
+    for (int32 i = 0; i < count; i++) {
+        if (!contains_name(declared, declared_count, &reads[i])) {
+            reads[(*read_count)++] = reads[i];
+        }
+    }
+    return complete;
+}
+
+// When optimizing, loads the globals a loop reads but nothing assigns
+// into hidden locals before the loop, so the loop body reads a stack slot
+// instead of hashing the name. Returns the hoisted count to restore when
+// the loop's scope ends. Nothing is hoisted in the REPL.
+static int32 hoist_loop_globals(int32 depth) {
+    int32 hoisted_count = current->hoisted_count;
+    Token reads[HOIST_SCAN_MAX];
+    int32 read_count;
+    if (!vm.optimize || vm.repl || !scan_loop_reads(depth, reads, &read_count)) {
+        return hoisted_count;
+    }
+
+    for (int32 i = 0; i < read_count; i++) {
+        Token* name = &reads[i];
+        if (current->hoisted_count == HOIST_MAX || current->local_count == UINT8_COUNT) {
+            break;
+        }
+        if (is_assigned(name) || is_visible_local(name) || resolve_hoisted(current, name) != -1) {
+            continue;
+        }
+
+        emit_bytes(OpHoistGlobal, identifier_constant(name));
+        Local* local = &current->locals[current->local_count++];
+        local->name.start = "";
+        local->name.length = 0;
+        local->depth = current->scope_depth;
+        local->is_captured = false;
+        local->is_written = false;
+        local->lifted = NULL;
+        local->lifted_count = 0;
+        local->type_id = -1;
+
+        Hoisted* hoisted = &current->hoisted[current->hoisted_count++];
+        hoisted->name = *name;
+        hoisted->slot = (uint8) (current->local_count - 1);
+    }
+    return hoisted_count;
+}
+
 static void define_variable(uint8 global) {
     if (current->scope_depth > 0) {
         mark_initialized();
@@ -386,173 +841,248 @@ static void define_variable(uint8 global) {
     emit_bytes(OpDefineGlobal, global);
 }
 
-static uint8 argument_list() {
-    uint8 arg_count = 0;
+static Expr* parse_expression() {
+    return parse_precedence(PrecAssignment);
+}
+
+static Expr* new_constant(ConstantType type) {
+    Expr* expr = new_expr(&ast_arena, ExprConstant, parser.previous.line);
+    expr->as.constant.type = type;
+    return expr;
+}
+
+static Expr** argument_list(uint8* arg_count) {
+    Expr* arguments[UINT8_COUNT];
+    uint8 count = 0;
     if (!check(TokenRightParen)) {
         do {
-            expression();
-            if (arg_count == 255) {
+            arguments[count] = parse_expression();
+            if (count == 255) {
                 error("Can't have more than 255 arguments.");
             }
-            arg_count++;
+            count++;
         } while (match(TokenComma));
     }
     consume(TokenRightParen, "Expect `)` after arguments.");
-    return arg_count;
-}
 
-static void and([[maybe_unused]] bool _can_assign) {
-    int32 end_jump = emit_jump(OpJumpIfFalse);
+    Expr** list = ARENA_ALLOCATE(&ast_arena, Expr*, count);
+    memcpy(list, arguments, sizeof(Expr*) * count);
+    *arg_count = count;
+    return list;
+}
 
-    emit_byte(OpPop);
-    parse_precedence(PrecAnd);
+static Expr* logical(Expr* left, TokenType operator_type, Precedence precedence) {
+    Expr* expr = new_expr(&ast_arena, ExprLogical, parser.previous.line);
+    expr->as.binary.operator_type = operator_type;
+    expr->as.binary.left = left;
+    expr->as.binary.right = parse_precedence(precedence);
+    return expr;
+}
 
-    patch_jump(end_jump);
+static Expr* and(Expr* left, [[maybe_unused]] bool _can_assign) {
+    return logical(left, TokenAnd, PrecAnd);
 }
 
-static void binary([[maybe_unused]] bool _can_assign) {
+static Expr* binary(Expr* left, [[maybe_unused]] bool _can_assign) {
     TokenType operator_type = parser.previous.type;
     ParseRule* rule = get_rule(operator_type);
-    parse_precedence((Precedence) (rule->precedence + 1));
+    Expr* right = parse_precedence((Precedence) (rule->precedence + 1));
 
-    switch (operator_type) {
-        case TokenBangEqual: {
-            emit_bytes(OpEqual, OpNot);
-            break;
-        }
-        case TokenEqualEqual: {
-            emit_byte(OpEqual);
-            break;
-        }
-        case TokenGreater: {
-            emit_byte(OpGreater);
-            break;
-        }
-        case TokenGreaterEqual: {
-            emit_bytes(OpLess, OpNot);
-            break;
-        }
-        case TokenLess: {
-            emit_byte(OpLess);
-            break;
-        }
-        case TokenLessEqual: {
-            emit_bytes(OpGreater, OpNot);
-            break;
-        }
-        case TokenPlus: {
-            emit_byte(OpAdd);
-            break;
-        }
-        case TokenMinus: {
-            emit_byte(OpSubtract);
-            break;
-        }
-        case TokenStar: {
-            emit_byte(OpMultiply);
-            break;
+    Expr* expr = new_expr(&ast_arena, ExprBinary, parser.previous.line);
+    expr->as.binary.operator_type = operator_type;
+    expr->as.binary.left = left;
+    expr->as.binary.right = right;
+    return expr;
+}
+
+// Arguments are substituted for parameters in an inlined body, so they
+// must be safe to read any number of times, or not at all.
+static bool is_simple_argument(Expr* expr) {
+    if (expr->type == ExprConstant) {
+        return true;
+    }
+    return expr->type == ExprVariable
+        && (expr->as.variable.get_op == OpGetLocal || expr->as.variable.get_op == OpGetUpvalue
+            || expr->as.variable.get_op == OpGetCopied);
+}
+
+static Expr* inline_call(Expr* call) {
+    Expr* callee = call->as.call.callee;
+    if (!vm.optimize || callee->type != ExprVariable
+        || (callee->as.variable.get_op != OpGetGlobal && callee->as.variable.get_op != OpGetHoisted)) {
+        return call;
+    }
+
+    Token* name = &callee->as.variable.name;
+    for (int32 i = inline_count - 1; i >= 0; i--) {
+        InlineCandidate* candidate = &inline_candidates[i];
+        ObjString* function_name = candidate->function->name;
+        if (function_name->length != name->length || memcmp(function_name->chars, name->start, name->length) != 0) {
+            continue;
         }
-        case TokenSlash: {
-            emit_byte(OpDivide);
-            break;
+
+        if (candidate->function->arity != call->as.call.arg_count) {
+            return call;
         }
-        default: {
-            return;  // Unreachable.
+        for (int32 j = 0; j < call->as.call.arg_count; j++) {
+            if (!is_simple_argument(call->as.call.arguments[j])) {
+                return call;
+            }
         }
+
+        Expr* expr = new_expr(&ast_arena, ExprInline, call->line);
+        expr->as.inlined.call = call;
+        expr->as.inlined.body = copy_expr(&ast_arena, candidate->body, call->as.call.arguments);
+        expr->as.inlined.candidate = i;
+        return expr;
+    }
+    return call;
+}
+
+// Appends the hidden arguments of a lifted local function.
+static Expr** lifted_arguments(Local* local, Expr** arguments, uint8* arg_count) {
+    if (*arg_count + local->lifted_count > UINT8_MAX) {
+        return arguments;
+    }
+
+    Expr** list = ARENA_ALLOCATE(&ast_arena, Expr*, *arg_count + local->lifted_count);
+    memcpy(list, arguments, sizeof(Expr*) * *arg_count);
+    for (int32 i = 0; i < local->lifted_count; i++) {
+        Expr* expr = new_expr(&ast_arena, ExprVariable, parser.previous.line);
+        expr->as.variable = local->lifted[i];
+        list[*arg_count + i] = expr;
     }
+    *arg_count += local->lifted_count;
+    return list;
 }
 
-static void call([[maybe_unused]] bool _can_assign) {
-    uint8 arg_count = argument_list();
-    emit_bytes(OpCall, arg_count);
+static Expr* call(Expr* callee, [[maybe_unused]] bool _can_assign) {
+    uint8 arg_count;
+    Expr** arguments = argument_list(&arg_count);
+
+    if (callee->type == ExprVariable && callee->as.variable.get_op == OpGetLocal) {
+        Local* local = &current->locals[callee->as.variable.slot];
+        if (local->lifted_count > 0) {
+            arguments = lifted_arguments(local, arguments, &arg_count);
+        }
+    }
+
+    Expr* expr = new_expr(&ast_arena, ExprCall, parser.previous.line);
+    expr->as.call.callee = callee;
+    expr->as.call.arguments = arguments;
+    expr->as.call.arg_count = arg_count;
+    return inline_call(expr);
 }
 
-static void dot(bool can_assign) {
+static Expr* dot(Expr* object, bool can_assign) {
     consume(TokenIdentifier, "Expect property name after `.`.");
-    uint8 name = identifier_constant(&parser.previous);
+    Token name = parser.previous;
 
+    Expr* expr;
     if (can_assign && match(TokenEqual)) {
-        expression();
-        emit_bytes(OpSetProperty, name);
+        Expr* value = parse_expression();
+        expr = new_expr(&ast_arena, ExprSet, parser.previous.line);
+        expr->as.property.value = value;
     } else if (match(TokenLeftParen)) {
-        uint8 arg_count = argument_list();
-        emit_bytes(OpInvoke, name);
-        emit_byte(arg_count);
+        uint8 arg_count;
+        Expr** arguments = argument_list(&arg_count);
+        expr = new_expr(&ast_arena, ExprInvoke, parser.previous.line);
+        expr->as.property.arguments = arguments;
+        expr->as.property.arg_count = arg_count;
     } else {
-        emit_bytes(OpGetProperty, name);
+        expr = new_expr(&ast_arena, ExprGet, parser.previous.line);
     }
+    expr->as.property.object = object;
+    expr->as.property.name = name;
+    return expr;
 }
 
-static void literal([[maybe_unused]] bool _can_assign) {
+static Expr* literal([[maybe_unused]] bool _can_assign) {
     switch (parser.previous.type) {
         case TokenFalse: {
-            emit_byte(OpFalse);
-            break;
+            Expr* expr = new_constant(ConstantBool);
+            expr->as.constant.as.boolean = false;
+            return expr;
         }
         case TokenNil: {
-            emit_byte(OpNil);
-            break;
+            return new_constant(ConstantNil);
         }
         case TokenTrue: {
-            emit_byte(OpTrue);
-            break;
+            Expr* expr = new_constant(ConstantBool);
+            expr->as.constant.as.boolean = true;
+            return expr;
         }
         default: {
-            return;  // Unreachable.
+            return NULL;  // Unreachable.
         }
     }
 }
 
-static void grouping([[maybe_unused]] bool _can_assign) {
-    expression();
+static Expr* grouping([[maybe_unused]] bool _can_assign) {
+    Expr* expr = parse_expression();
     consume(TokenRightParen, "Expect `)` after expression.");
+    return expr;
 }
 
-static void number([[maybe_unused]] bool _can_assign) {
-    float64 value = strtod(parser.previous.start, NULL);
-    emit_constant(number_val(value));
+static Expr* number([[maybe_unused]] bool _can_assign) {
+    Expr* expr = new_constant(ConstantNumber);
+    expr->as.constant.as.number = strtod(parser.previous.start, NULL);
+    return expr;
 }
 
-static void or([[maybe_unused]] bool _can_assign) {
-    int32 else_jump = emit_jump(OpJumpIfFalse);
-    int32 end_jump = emit_jump(OpJump);
-
-    patch_jump(else_jump);
-    emit_byte(OpPop);
-
-    parse_precedence(PrecOr);
-    patch_jump(end_jump);
+static Expr* or(Expr* left, [[maybe_unused]] bool _can_assign) {
+    return logical(left, TokenOr, PrecOr);
 }
 
-static void string([[maybe_unused]] bool _can_assign) {
-    emit_constant(obj_val((Obj*) copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+static Expr* string([[maybe_unused]] bool _can_assign) {
+    Expr* expr = new_constant(ConstantString);
+    expr->as.constant.as.string.chars = parser.previous.start + 1;
+    expr->as.constant.as.string.length = parser.previous.length - 2;
+    return expr;
 }
 
-static void named_variable(Token name, bool can_assign) {
-    uint8 get_op, set_op;
-    int32 arg = resolve_local(current, &name);
-    if (arg != -1) {
-        get_op = OpGetLocal;
-        set_op = OpSetLocal;
-    } else if ((arg = resolve_upvalue(current, &name)) != -1) {
-        get_op = OpGetUpvalue;
-        set_op = OpSetUpvalue;
+static Variable resolve_variable(Token name) {
+    Variable variable;
+    bool is_copied;
+    variable.name = name;
+    if ((variable.slot = resolve_local(current, &name)) != -1) {
+        variable.get_op = OpGetLocal;
+        variable.set_op = OpSetLocal;
+    } else if ((variable.slot = resolve_upvalue(current, &name, &is_copied)) != -1) {
+        variable.get_op = is_copied ? OpGetCopied : OpGetUpvalue;
+        variable.set_op = OpSetUpvalue;
+    } else if ((variable.slot = resolve_hoisted(current, &name)) != -1) {
+        // Never assigned, or it would not have been hoisted.
+        variable.get_op = OpGetHoisted;
+        variable.set_op = OpSetGlobal;
     } else {
-        arg = identifier_constant(&name);
-        get_op = OpGetGlobal;
-        set_op = OpSetGlobal;
+        variable.get_op = OpGetGlobal;
+        variable.set_op = OpSetGlobal;
     }
+    return variable;
+}
+
+static Expr* named_variable(Token name, bool can_assign) {
+    Variable variable = resolve_variable(name);
 
     if (can_assign && match(TokenEqual)) {
-        expression();
-        emit_bytes(set_op, (uint8) arg);
-    } else {
-        emit_bytes(get_op, (uint8) arg);
+        if (variable.get_op == OpGetLocal) {
+            current->locals[variable.slot].is_written = true;
+        }
+        Expr* value = parse_expression();
+        Expr* expr = new_expr(&ast_arena, ExprAssign, parser.previous.line);
+        expr->as.assign.variable = variable;
+        expr->as.assign.value = value;
+        return expr;
     }
+
+    Expr* expr = new_expr(&ast_arena, ExprVariable, parser.previous.line);
+    expr->as.variable = variable;
+    return expr;
 }
 
-static void variable(bool can_assign) {
-    named_variable(parser.previous, can_assign);
+static Expr* variable(bool can_assign) {
+    return named_variable(parser.previous, can_assign);
 }
 
 static Token synthetic_token(const char* text) {
@@ -562,7 +1092,7 @@ static Token synthetic_token(const char* text) {
     return token;
 }
 
-static void super([[maybe_unused]] bool _can_assign) {
+static Expr* super([[maybe_unused]] bool _can_assign) {
     if (current_class == NULL) {
         error("Can't use `super` outside of a class.");
     } else if (!current_class->has_superclass) {
@@ -571,47 +1101,45 @@ static void super([[maybe_unused]] bool _can_assign) {
 
     consume(TokenDot, "Expect `.` after `super`.");
     consume(TokenIdentifier, "Expect superclass method name.");
-    uint8 name = identifier_constant(&parser.previous);
+    Token name = parser.previous;
 
-    named_variable(synthetic_token("this"), false);
+    Expr* receiver = named_variable(synthetic_token("this"), false);
+    bool invoke = false;
+    Expr** arguments = NULL;
+    uint8 arg_count = 0;
     if (match(TokenLeftParen)) {
-        uint8 arg_count = argument_list();
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OpSuperInvoke, name);
-        emit_byte(arg_count);
-    } else {
-        named_variable(synthetic_token("super"), false);
-        emit_bytes(OpGetSuper, name);
+        invoke = true;
+        arguments = argument_list(&arg_count);
     }
+    Expr* superclass = named_variable(synthetic_token("super"), false);
+
+    Expr* expr = new_expr(&ast_arena, ExprSuper, parser.previous.line);
+    expr->as.super.name = name;
+    expr->as.super.receiver = receiver;
+    expr->as.super.superclass = superclass;
+    expr->as.super.invoke = invoke;
+    expr->as.super.arguments = arguments;
+    expr->as.super.arg_count = arg_count;
+    return expr;
 }
 
-static void this([[maybe_unused]] bool _can_assign) {
+static Expr* this([[maybe_unused]] bool _can_assign) {
     if (current_class == NULL) {
         error("Can't use \"this\" outside of a class.");
-        return;
+        return new_constant(ConstantNil);
     }
 
-    variable(false);
+    return variable(false);
 }
 
-static void unary([[maybe_unused]] bool _can_assign) {
+static Expr* unary([[maybe_unused]] bool _can_assign) {
     TokenType operator_type = parser.previous.type;
+    Expr* operand = parse_precedence(PrecUnary);
 
-    parse_precedence(PrecUnary);
-
-    switch (operator_type) {
-        case TokenBang: {
-            emit_byte(OpNot);
-            break;
-        }
-        case TokenMinus: {
-            emit_byte(OpNegate);
-            break;
-        }
-        default: {
-            return;  // Unreachable.
-        }
-    }
+    Expr* expr = new_expr(&ast_arena, ExprUnary, parser.previous.line);
+    expr->as.unary.operator_type = operator_type;
+    expr->as.unary.operand = operand;
+    return expr;
 }
 
 ParseRule rules[] = {
@@ -657,69 +1185,516 @@ ParseRule rules[] = {
     [TokenEOF] = { NULL, NULL, PrecNone },
 };
 
-static void parse_precedence(Precedence precedence) {
+static Expr* parse_precedence(Precedence precedence) {
     advance();
-    ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+    PrefixFn prefix_rule = get_rule(parser.previous.type)->prefix;
     if (prefix_rule == NULL) {
         error("Exptect expression.");
-        return;
+        return new_constant(ConstantNil);
     }
 
     bool can_assign = precedence <= PrecAssignment;
-    prefix_rule(can_assign);
+    Expr* expr = prefix_rule(can_assign);
 
     while (precedence <= get_rule(parser.current.type)->precedence) {
         advance();
-        ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+        InfixFn infix_rule = get_rule(parser.previous.type)->infix;
+        expr = infix_rule(expr, can_assign);
     }
 
     if (can_assign && match(TokenEqual)) {
         error("Invalid assignment target.");
     }
+
+    return expr;
 }
 
 static ParseRule* get_rule(TokenType type) {
     return &rules[type];
 }
 
-static void expression() {
-    parse_precedence(PrecAssignment);
-}
+static void compile_expr(Expr* expr);
 
-static void block() {
-    while (!check(TokenRightBrace) && !check(TokenEOF)) {
-        declaration();
+static void compile_constant(Constant* constant) {
+    switch (constant->type) {
+        case ConstantNil: {
+            emit_byte(OpNil);
+            break;
+        }
+        case ConstantBool: {
+            emit_byte(constant->as.boolean ? OpTrue : OpFalse);
+            break;
+        }
+        case ConstantNumber: {
+            emit_constant(number_val(constant->as.number));
+            break;
+        }
+        case ConstantString: {
+            emit_constant(copy_string_value(constant->as.string.chars, constant->as.string.length));
+            break;
+        }
     }
-    consume(TokenRightBrace, "Expect `}` after block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
+// Globals get their name constant when they are emitted, so constants
+// are still added in source order.
+static uint8 variable_operand(Variable* variable) {
+    if (variable->slot != -1) {
+        return (uint8) variable->slot;
+    }
+    return identifier_constant(&variable->name);
+}
 
-    consume(TokenLeftParen, "Expect `(` after function name.");
-    if (!check(TokenRightParen)) {
-        do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                error_at_current("Can't have more than 255 parameters.");
-            }
-            uint8 constant = parse_variable("Expect parameter name.");
-            define_variable(constant);
-        } while (match(TokenComma));
+static void compile_arguments(Expr** arguments, uint8 arg_count) {
+    for (int32 i = 0; i < arg_count; i++) {
+        compile_expr(arguments[i]);
     }
-    consume(TokenRightParen, "Expect `)` after parameters.");
-    consume(TokenLeftBrace, "Expect `{` before function body.");
-    block();
+}
 
-    ObjFunction* function = end_compiler();
-    emit_bytes(OpClosure, make_constant(obj_val((Obj*) function)));
+// Whether `expr` always evaluates to a number, if it evaluates at all.
+// Arithmetic other than `+` can only produce numbers, whatever its
+// operands. A typed local counts until something else is stored in it,
+// and is added to `deps`.
+static bool infer_number(Expr* expr, uint64* deps) {
+    switch (expr->type) {
+        case ExprConstant: {
+            return expr->as.constant.type == ConstantNumber;
+        }
+        case ExprVariable: {
+            if (expr->as.variable.get_op != OpGetLocal) {
+                return false;
+            }
+            int32 type_id = current->locals[expr->as.variable.slot].type_id;
+            if (type_id == -1 || (current->not_number & ((uint64) 1 << type_id)) != 0) {
+                return false;
+            }
+            *deps |= (uint64) 1 << type_id;
+            return true;
+        }
+        case ExprAssign: {
+            return infer_number(expr->as.assign.value, deps);
+        }
+        case ExprUnary: {
+            return expr->as.unary.operator_type == TokenMinus;
+        }
+        case ExprBinary: {
+            switch (expr->as.binary.operator_type) {
+                case TokenMinus:
+                case TokenStar:
+                case TokenSlash: {
+                    return true;
+                }
+                case TokenPlus: {
+                    return infer_number(expr->as.binary.left, deps) && infer_number(expr->as.binary.right, deps);
+                }
+                default: {
+                    return false;
+                }
+            }
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+// Emits `unchecked` instead of `checked` when the operands are known to be
+// numbers, remembering it in case a local it relied on stops being one.
+static void emit_arithmetic(uint8 checked, uint8 unchecked, bool known, uint64 deps) {
+    if (!known || current->unreachable) {
+        emit_byte(checked);
+        return;
+    }
+
+    if (current->elided_capacity < current->elided_count + 1) {
+        int32 old_capacity = current->elided_capacity;
+        current->elided_capacity = GROW_CAPACITY(old_capacity);
+        current->elided = ARENA_GROW_ARRAY(&compiler_arena, ElidedCheck, current->elided, old_capacity, current->elided_capacity);
+    }
+    ElidedCheck* check = &current->elided[current->elided_count++];
+    check->offset = current_chunk()->count;
+    check->deps = deps;
+    emit_byte(unchecked);
+}
+
+// Types a local from its initializer, or from each value later stored in it.
+static void store_local(Local* local, Expr* value) {
+    uint64 deps = 0;
+    bool known = value != NULL && infer_number(value, &deps);
+    if (local->type_id == -1) {
+        if (known && current->typed_count < TYPED_MAX) {
+            local->type_id = current->typed_count++;
+            current->number_deps[local->type_id] = deps;
+        }
+    } else if (known) {
+        current->number_deps[local->type_id] |= deps;
+    } else {
+        forget_number(current, local->type_id);
+    }
+}
+
+static void compile_binary(Expr* expr) {
+    compile_expr(expr->as.binary.left);
+    compile_expr(expr->as.binary.right);
+
+    uint64 deps = 0;
+    bool known = infer_number(expr->as.binary.left, &deps) && infer_number(expr->as.binary.right, &deps);
+
+    switch (expr->as.binary.operator_type) {
+        case TokenBangEqual: {
+            emit_bytes(OpEqual, OpNot);
+            break;
+        }
+        case TokenEqualEqual: {
+            emit_byte(OpEqual);
+            break;
+        }
+        case TokenGreater: {
+            emit_byte(OpGreater);
+            break;
+        }
+        case TokenGreaterEqual: {
+            emit_bytes(OpLess, OpNot);
+            break;
+        }
+        case TokenLess: {
+            emit_byte(OpLess);
+            break;
+        }
+        case TokenLessEqual: {
+            emit_bytes(OpGreater, OpNot);
+            break;
+        }
+        case TokenPlus: {
+            emit_arithmetic(OpAdd, OpAddNumber, known, deps);
+            break;
+        }
+        case TokenMinus: {
+            emit_arithmetic(OpSubtract, OpSubtractNumber, known, deps);
+            break;
+        }
+        case TokenStar: {
+            emit_arithmetic(OpMultiply, OpMultiplyNumber, known, deps);
+            break;
+        }
+        case TokenSlash: {
+            emit_arithmetic(OpDivide, OpDivideNumber, known, deps);
+            break;
+        }
+        default: {
+            return;  // Unreachable.
+        }
+    }
+}
+
+static void compile_logical(Expr* expr) {
+    compile_expr(expr->as.binary.left);
+
+    if (expr->as.binary.operator_type == TokenAnd) {
+        int32 end_jump = emit_jump(OpJumpIfFalse);
+
+        emit_byte(OpPop);
+        compile_expr(expr->as.binary.right);
+
+        patch_jump(end_jump);
+    } else {
+        int32 else_jump = emit_jump(OpJumpIfFalse);
+        int32 end_jump = emit_jump(OpJump);
+
+        patch_jump(else_jump);
+        emit_byte(OpPop);
+
+        compile_expr(expr->as.binary.right);
+        patch_jump(end_jump);
+    }
+}
+
+static int32 emit_guard(uint8 function) {
+    if (current->unreachable) {
+        return -1;
+    }
+    emit_bytes(OpInlineGuard, function);
+    emit_byte(0xff);
+    emit_byte(0xff);
+    return current_chunk()->count - 2;
+}
+
+// The callee is loaded as usual. If it is still the inlined function, the
+// body runs in its place, with lines from the function's source.
+// Otherwise the arguments are pushed and the call made after all.
+static void compile_inline(Expr* expr) {
+    Expr* call = expr->as.inlined.call;
+    ObjFunction* function = inline_candidates[expr->as.inlined.candidate].function;
+
+    compile_expr(call->as.call.callee);
+    int32 fallback_jump = emit_guard(make_constant(obj_val((Obj*) function)));
+    InlineSite site;
+    site.start = current_chunk()->count;
+    site.line = expr->line;
+    site.name = function->name;
+    compile_expr(expr->as.inlined.body);
+    site.end = current_chunk()->count;
+    int32 end_jump = emit_jump(OpJump);
+    if (fallback_jump != -1) {
+        add_inline_site(current_chunk(), &compiler_arena, site);
+    }
+
+    patch_jump(fallback_jump);
+    compile_arguments(call->as.call.arguments, call->as.call.arg_count);
+    emit_bytes(OpCall, call->as.call.arg_count);
+    patch_jump(end_jump);
+}
+
+static void compile_expr(Expr* expr) {
+    // Bytecode is attributed to the line on which its node was parsed.
+    Token previous = parser.previous;
+    parser.previous.line = expr->line;
+
+    switch (expr->type) {
+        case ExprConstant: {
+            compile_constant(&expr->as.constant);
+            break;
+        }
+        case ExprVariable: {
+            Variable* variable = &expr->as.variable;
+            if (variable->get_op == OpGetHoisted) {
+                emit_bytes(OpGetHoisted, (uint8) variable->slot);
+                emit_byte(identifier_constant(&variable->name));
+                break;
+            }
+            emit_bytes(variable->get_op, variable_operand(variable));
+            break;
+        }
+        case ExprAssign: {
+            uint8 arg = variable_operand(&expr->as.assign.variable);
+            compile_expr(expr->as.assign.value);
+            emit_bytes(expr->as.assign.variable.set_op, arg);
+            if (expr->as.assign.variable.set_op == OpSetLocal) {
+                Local* local = &current->locals[expr->as.assign.variable.slot];
+                if (local->type_id != -1) {
+                    store_local(local, expr->as.assign.value);
+                }
+            }
+            break;
+        }
+        case ExprUnary: {
+            compile_expr(expr->as.unary.operand);
+            if (expr->as.unary.operator_type == TokenBang) {
+                emit_byte(OpNot);
+                break;
+            }
+            uint64 deps = 0;
+            bool known = infer_number(expr->as.unary.operand, &deps);
+            emit_arithmetic(OpNegate, OpNegateNumber, known, deps);
+            break;
+        }
+        case ExprBinary: {
+            compile_binary(expr);
+            break;
+        }
+        case ExprLogical: {
+            compile_logical(expr);
+            break;
+        }
+        case ExprCall: {
+            compile_expr(expr->as.call.callee);
+            compile_arguments(expr->as.call.arguments, expr->as.call.arg_count);
+            emit_bytes(OpCall, expr->as.call.arg_count);
+            break;
+        }
+        case ExprGet: {
+            compile_expr(expr->as.property.object);
+            emit_bytes(OpGetProperty, identifier_constant(&expr->as.property.name));
+            break;
+        }
+        case ExprSet: {
+            compile_expr(expr->as.property.object);
+            uint8 name = identifier_constant(&expr->as.property.name);
+            compile_expr(expr->as.property.value);
+            emit_bytes(OpSetProperty, name);
+            break;
+        }
+        case ExprInvoke: {
+            compile_expr(expr->as.property.object);
+            uint8 name = identifier_constant(&expr->as.property.name);
+            compile_arguments(expr->as.property.arguments, expr->as.property.arg_count);
+            emit_bytes(OpInvoke, name);
+            emit_byte(expr->as.property.arg_count);
+            break;
+        }
+        case ExprSuper: {
+            uint8 name = identifier_constant(&expr->as.super.name);
+            compile_expr(expr->as.super.receiver);
+            if (expr->as.super.invoke) {
+                compile_arguments(expr->as.super.arguments, expr->as.super.arg_count);
+                compile_expr(expr->as.super.superclass);
+                emit_bytes(OpSuperInvoke, name);
+                emit_byte(expr->as.super.arg_count);
+            } else {
+                compile_expr(expr->as.super.superclass);
+                emit_bytes(OpGetSuper, name);
+            }
+            break;
+        }
+        case ExprInline: {
+            compile_inline(expr);
+            break;
+        }
+    }
+
+    parser.previous = previous;
+}
+
+// Parses a whole expression, folding it when optimizing. The tree is only
+// valid until ast_arena is released.
+static Expr* expression_tree() {
+    Expr* expr = parse_expression();
+    if (vm.optimize) {
+        expr = fold_expr(&ast_arena, expr);
+    }
+    return expr;
+}
+
+static void expression() {
+    ArenaMark mark = arena_mark(&ast_arena);
+    compile_expr(expression_tree());
+    arena_release(&ast_arena, mark);
+}
+
+// Compiles `a < b`, `a > b` or `a == b` into a single instruction that
+// consumes both operands and jumps when the comparison is false.
+static bool compare_jump(Expr* expr, int32* exit_jump) {
+    if (expr->type != ExprBinary) {
+        return false;
+    }
+
+    uint8 instruction;
+    switch (expr->as.binary.operator_type) {
+        case TokenLess: {
+            instruction = OpJumpIfNotLess;
+            break;
+        }
+        case TokenGreater: {
+            instruction = OpJumpIfNotGreater;
+            break;
+        }
+        case TokenEqualEqual: {
+            instruction = OpJumpIfNotEqual;
+            break;
+        }
+        default: {
+            return false;
+        }
+    }
+
+    compile_expr(expr->as.binary.left);
+    compile_expr(expr->as.binary.right);
+    Token previous = parser.previous;
+    parser.previous.line = expr->line;
+    *exit_jump = emit_jump(instruction);
+    parser.previous = previous;
+    return true;
+}
+
+// Compiles a condition along with the jump taken when it is false, which
+// must be patched with patch_condition(). A condition that folds to a
+// constant is not compiled at all, and the caller drops the branch that
+// can't be taken.
+static Condition compile_condition(Expr* expr, int32* exit_jump) {
+    *exit_jump = -1;
+    if (vm.optimize && expr->type == ExprConstant) {
+        return constant_is_falsey(&expr->as.constant) ? ConditionFalse : ConditionTrue;
+    }
+    if (!compare_jump(expr, exit_jump)) {
+        compile_expr(expr);
+        *exit_jump = emit_jump(OpJumpIfFalse);
+        emit_byte(OpPop);
+    }
+    return ConditionUnknown;
+}
+
+static Condition condition(int32* exit_jump) {
+    ArenaMark mark = arena_mark(&ast_arena);
+    Condition result = compile_condition(expression_tree(), exit_jump);
+    arena_release(&ast_arena, mark);
+    return result;
+}
+
+// OpJumpIfFalse leaves the condition on the stack, so the side it jumps to
+// pops it too. Fused jumps have already consumed their operands.
+static bool leaves_condition(int32 exit_jump) {
+    return exit_jump != -1 && current_chunk()->code[exit_jump - 1] == OpJumpIfFalse;
+}
+
+static void patch_condition(int32 exit_jump) {
+    bool pop = leaves_condition(exit_jump);
+    patch_jump(exit_jump);
+    if (pop) {
+        emit_byte(OpPop);
+    }
+}
+
+static void load_variable(Token name) {
+    ArenaMark mark = arena_mark(&ast_arena);
+    compile_expr(named_variable(name, false));
+    arena_release(&ast_arena, mark);
+}
+
+static void block() {
+    while (!check(TokenRightBrace) && !check(TokenEOF)) {
+        declaration();
+    }
+    consume(TokenRightBrace, "Expect `}` after block.");
+}
+
+static void function(FunctionType type, Variable* lifted, int32 lifted_count) {
+    init_compiler(type);
+    begin_scope();
+
+    consume(TokenLeftParen, "Expect `(` after function name.");
+    if (!check(TokenRightParen)) {
+        do {
+            current->function->arity++;
+            if (current->function->arity > 255) {
+                error_at_current("Can't have more than 255 parameters.");
+            }
+            uint8 constant = parse_variable("Expect parameter name.");
+            define_variable(constant);
+        } while (match(TokenComma));
+    }
+    consume(TokenRightParen, "Expect `)` after parameters.");
+    for (int32 i = 0; i < lifted_count; i++) {
+        current->function->arity++;
+        current->function->lifted++;
+        add_local(lifted[i].name);
+        mark_initialized();
+    }
+    consume(TokenLeftBrace, "Expect `{` before function body.");
+    current->capture_return = vm.optimize && type == TypeFunction && check(TokenReturn);
+    block();
+    Expr* returned = current->returned;
+
+    // The compiler itself is released by end_compiler().
+    Upvalue upvalues[UINT8_COUNT];
+    Upvalue copied[UINT8_COUNT];
+    memcpy(upvalues, current->upvalues, sizeof(Upvalue) * current->function->upvalue_count);
+    memcpy(copied, current->copied, sizeof(Upvalue) * current->function->copied_count);
+
+    ObjFunction* function = end_compiler();
+    if (returned != NULL && current->type == TypeScript && current->scope_depth == 0 && inline_count < INLINE_MAX) {
+        InlineCandidate* candidate = &inline_candidates[inline_count++];
+        candidate->function = function;
+        candidate->body = returned;
+    }
+    emit_bytes(OpClosure, make_constant(obj_val((Obj*) function)));
 
     for (int32 i = 0; i < function->upvalue_count; i++) {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_byte(upvalues[i].is_local ? 1 : 0);
+        emit_byte(upvalues[i].index);
+    }
+    for (int32 i = 0; i < function->copied_count; i++) {
+        emit_byte(copied[i].is_local ? 1 : 0);
+        emit_byte(copied[i].index);
     }
 }
 
@@ -731,7 +1706,7 @@ static void method() {
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
         type = TypeInitializer;
     }
-    function(type);
+    function(type, NULL, 0);
     emit_bytes(OpMethod, constant);
 }
 
@@ -751,7 +1726,7 @@ static void class_declaration() {
 
     if (match(TokenLess)) {
         consume(TokenIdentifier, "Expect superclass name.");
-        variable(false);
+        load_variable(parser.previous);
 
         if (identifiers_equal(&class_name, &parser.previous)) {
             error("A class can't inherit from itself.");
@@ -761,12 +1736,12 @@ static void class_declaration() {
         add_local(synthetic_token("super"));
         define_variable(0);
 
-        named_variable(class_name, false);
+        load_variable(class_name);
         emit_byte(OpInherit);
         class_compiler.has_superclass = true;
     }
 
-    named_variable(class_name, false);
+    load_variable(class_name);
     consume(TokenLeftBrace, "Expect `{` before class body.");
     while (!check(TokenRightBrace) && !check(TokenEOF)) {
         method();
@@ -781,18 +1756,164 @@ static void class_declaration() {
     current_class = current_class->enclosing;
 }
 
+// Scans the function being declared as `name` and the rest of the block
+// declaring it. Fails if the function is named anywhere except as the
+// callee of a call in this same function, or if it declares functions of
+// its own, which could keep what it captures alive.
+static bool scan_lift(Token* name, Token* reads, int32* read_count, Token* declared, int32* declared_count) {
+    *read_count = 0;
+    *declared_count = 0;
+
+    Token token;
+    while ((token = scan_token()).type != TokenRightParen) {
+        if (token.type == TokenEOF) {
+            return false;
+        }
+        if (token.type == TokenIdentifier) {
+            if (*declared_count == UINT8_MAX - LIFT_MAX) {
+                return false;
+            }
+            declared[(*declared_count)++] = token;
+        }
+    }
+    Token previous = scan_token();
+    if (previous.type != TokenLeftBrace) {
+        return false;
+    }
+
+    for (int32 depth = 1; depth > 0; ) {
+        token = scan_token();
+        switch (token.type) {
+            case TokenEOF:
+            case TokenFun:
+            case TokenClass: {
+                return false;
+            }
+            case TokenLeftBrace: {
+                depth++;
+                break;
+            }
+            case TokenRightBrace: {
+                depth--;
+                break;
+            }
+            case TokenIdentifier: {
+                if (previous.type == TokenDot) {
+                    break;
+                }
+                if (identifiers_equal(&token, name)) {
+                    return false;
+                }
+                if (previous.type == TokenVar) {
+                    if (*declared_count < HOIST_SCAN_MAX) {
+                        declared[(*declared_count)++] = token;
+                    }
+                } else if (*read_count < HOIST_SCAN_MAX && !contains_name(reads, *read_count, &token)) {
+                    reads[(*read_count)++] = token;
+                }
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+        previous = token;
+    }
+
+    Nesting nesting;
+    init_nesting(&nesting);
+    TokenType before = TokenEOF;
+    while (true) {
+        token = scan_token();
+        if (token.type == TokenEOF) {
+            return false;
+        }
+        if (token.type == TokenRightBrace && nesting.depth == 0) {
+            return true;
+        }
+        if (previous.type == TokenIdentifier && before != TokenDot && identifiers_equal(&previous, name)
+            && (token.type != TokenLeftParen || nesting.function_depth > 0)) {
+            return false;
+        }
+        track_nesting(&nesting, &token);
+        before = previous.type;
+        previous = token;
+    }
+}
+
+// When optimizing, a local function that is only ever called directly is
+// lambda lifted: each variable of the enclosing functions it reads becomes
+// a hidden parameter that calls pass after their arguments, so neither
+// the variable nor the function needs an upvalue. This is only sound for
+// variables that no function nested deeper than their own assigns, which
+// can't change while the call runs.
+static int32 plan_lift(Token* name, Variable* lifted) {
+    Token reads[HOIST_SCAN_MAX];
+    Token declared[HOIST_SCAN_MAX];
+    int32 read_count;
+    int32 declared_count;
+
+    Scanner saved = save_scanner();
+    bool liftable = scan_lift(name, reads, &read_count, declared, &declared_count);
+    restore_scanner(saved);
+    if (!liftable) {
+        return 0;
+    }
+
+    int32 depth = 0;
+    for (Compiler* compiler = current->enclosing; compiler != NULL; compiler = compiler->enclosing) {
+        depth++;
+    }
+
+    int32 count = 0;
+    for (int32 i = 0; i < read_count && count < LIFT_MAX; i++) {
+        Token* read = &reads[i];
+        if (contains_name(declared, declared_count, read)) {
+            continue;
+        }
+
+        int32 level = depth;
+        Compiler* compiler = current;
+        while (compiler != NULL && !contains_local(compiler, read)) {
+            compiler = compiler->enclosing;
+            level--;
+        }
+        if (compiler == NULL || is_assigned_below(read, level)) {
+            continue;
+        }
+        lifted[count++] = resolve_variable(*read);
+    }
+    return count;
+}
+
 static void fun_declaration() {
     uint8 global = parse_variable("Expect function name.");
     mark_initialized();
-    function(TypeFunction);
+
+    Variable lifted[LIFT_MAX];
+    int32 lifted_count = 0;
+    if (vm.optimize && current->scope_depth > 0) {
+        lifted_count = plan_lift(&parser.previous, lifted);
+    }
+    function(TypeFunction, lifted, lifted_count);
+
+    if (lifted_count > 0) {
+        Local* local = &current->locals[current->local_count - 1];
+        local->lifted = ARENA_ALLOCATE(&compiler_arena, Variable, lifted_count);
+        memcpy(local->lifted, lifted, sizeof(Variable) * lifted_count);
+        local->lifted_count = lifted_count;
+    }
     define_variable(global);
 }
 
 static void var_declaration() {
     uint8 global = parse_variable("Expect variable name.");
 
+    ArenaMark mark = arena_mark(&ast_arena);
+    Expr* value = NULL;
     if (match(TokenEqual)) {
-        expression();
+        value = expression_tree();
+        compile_expr(value);
     } else {
         emit_byte(OpNil);
 
@@ -800,6 +1921,10 @@ static void var_declaration() {
 
     consume(TokenSemicolon, "Expect `;` after variable declaration");
 
+    if (current->scope_depth > 0) {
+        store_local(&current->locals[current->local_count - 1], value);
+    }
+    arena_release(&ast_arena, mark);
     define_variable(global);
 }
 
@@ -809,34 +1934,179 @@ static void expression_statement() {
     emit_byte(OpPop);
 }
 
-static void for_statement() {
-    begin_scope();
+static bool is_local_read(Expr* expr, int32 slot) {
+    return expr->type == ExprVariable && expr->as.variable.get_op == OpGetLocal && expr->as.variable.slot == slot;
+}
 
-    consume(TokenLeftParen, "Expect `(` after `for.`");
-    if (match(TokenSemicolon)) {
-        // No initializer.
-    } else if (match(TokenVar)) {
-        var_declaration();
+// Matches the header of a counted loop, `i < bound; i = i + step`, where
+// `i` is the loop's own variable, `step` is a number and `bound` is a
+// number or another local. The comparison may be any of <, <=, > and >=,
+// and the step may be subtracted.
+static bool counted_loop(int32 counter, Expr* test, Expr* increment, CountedLoop* loop) {
+    if (counter == -1 || test == NULL || increment == NULL) {
+        return false;
+    }
+
+    if (test->type != ExprBinary || !is_local_read(test->as.binary.left, counter)) {
+        return false;
+    }
+    switch (test->as.binary.operator_type) {
+        case TokenLess: {
+            loop->mode = ForLess;
+            break;
+        }
+        case TokenLessEqual: {
+            loop->mode = ForLessEqual;
+            break;
+        }
+        case TokenGreater: {
+            loop->mode = ForGreater;
+            break;
+        }
+        case TokenGreaterEqual: {
+            loop->mode = ForGreaterEqual;
+            break;
+        }
+        default: {
+            return false;
+        }
+    }
+
+    loop->bound = test->as.binary.right;
+    if (loop->bound->type == ExprVariable) {
+        Variable* bound = &loop->bound->as.variable;
+        if ((bound->get_op != OpGetLocal && bound->get_op != OpGetHoisted) || bound->slot == counter) {
+            return false;
+        }
+        loop->mode |= ForLocalBound;
+    } else if (loop->bound->type != ExprConstant || loop->bound->as.constant.type != ConstantNumber) {
+        return false;
+    }
+
+    if (increment->type != ExprAssign || increment->as.assign.variable.set_op != OpSetLocal
+        || increment->as.assign.variable.slot != counter) {
+        return false;
+    }
+    Expr* value = increment->as.assign.value;
+    if (value->type != ExprBinary || !is_local_read(value->as.binary.left, counter)) {
+        return false;
+    }
+    Expr* step = value->as.binary.right;
+    if (step->type != ExprConstant || step->as.constant.type != ConstantNumber) {
+        return false;
+    }
+    switch (value->as.binary.operator_type) {
+        case TokenPlus: {
+            loop->step = step->as.constant.as.number;
+            break;
+        }
+        case TokenMinus: {
+            loop->step = -step->as.constant.as.number;
+            break;
+        }
+        default: {
+            return false;
+        }
+    }
+
+    loop->counter = (uint8) counter;
+    loop->line = increment->line;
+    return true;
+}
+
+static void emit_for_loop(CountedLoop* loop, int32 body_start) {
+    if (current->unreachable) {
+        return;
+    }
+
+    Token previous = parser.previous;
+    parser.previous.line = loop->line;
+    uint8 step = make_constant(number_val(loop->step));
+    uint8 bound;
+    if (loop->mode & ForLocalBound) {
+        bound = (uint8) loop->bound->as.variable.slot;
     } else {
-        expression_statement();
+        bound = make_constant(number_val(loop->bound->as.constant.as.number));
     }
+    emit_bytes(OpForLoop, loop->counter);
+    emit_bytes(step, bound);
+    emit_byte(loop->mode);
 
+    int32 offset = current_chunk()->count - body_start + 2;
+    if (offset > UINT16_MAX) {
+        error("Loop body too large.");
+    }
+    emit_byte((offset >> 8) & 0xff);
+    emit_byte(offset & 0xff);
+    parser.previous = previous;
+}
+
+// A counted loop tests its condition once on entry and then at the
+// bottom of the body. If the body doesn't write the counter or the bound
+// and no closure captures them, the bottom test is a single OpForLoop
+// without type checks: the entry test has already seen numbers, and
+// nothing else can change them.
+static void counted_for(CountedLoop* loop, Expr* test, Expr* increment) {
+    int32 exit_jump;
+    compile_condition(test, &exit_jump);
+
+    // The flags are cleared to see what this body writes, then the old
+    // ones are merged back in. An enclosing loop over the same locals may
+    // already have seen writes to them.
+    Local* counter = &current->locals[loop->counter];
+    Local* bound = loop->mode & ForLocalBound ? &current->locals[loop->bound->as.variable.slot] : NULL;
+    bool counter_written = counter->is_written;
+    bool bound_written = bound != NULL && bound->is_written;
+    counter->is_written = false;
+    if (bound != NULL) {
+        bound->is_written = false;
+    }
+
+    int32 body_start = current_chunk()->count;
+    statement();
+
+    bool fused = !counter->is_written && !counter->is_captured;
+    counter->is_written |= counter_written;
+    if (bound != NULL) {
+        fused = fused && !bound->is_written && !bound->is_captured;
+        bound->is_written |= bound_written;
+    }
+
+    if (fused) {
+        emit_for_loop(loop, body_start);
+        // OpForLoop exits with nothing to pop.
+        int32 done_jump = leaves_condition(exit_jump) ? emit_jump(OpJump) : -1;
+        patch_condition(exit_jump);
+        patch_jump(done_jump);
+    } else {
+        compile_expr(increment);
+        emit_byte(OpPop);
+        int32 repeat_jump;
+        compile_condition(test, &repeat_jump);
+        emit_loop(body_start);
+        patch_jump(repeat_jump);
+        patch_condition(exit_jump);
+    }
+}
+
+static void general_for(Expr* test, Expr* increment) {
     int32 loop_start = current_chunk()->count;
     int32 exit_jump = -1;
-    if (!match(TokenSemicolon)) {
-        expression();
-        consume(TokenSemicolon, "Expect `;` after loop condition.");
+    Condition known = ConditionTrue;
+    if (test != NULL) {
+        known = compile_condition(test, &exit_jump);
+    }
 
-        exit_jump = emit_jump(OpJumpIfFalse);
-        emit_byte(OpPop);
+    bool unreachable = current->unreachable;
+    if (known == ConditionFalse) {
+        current->unreachable = true;
     }
 
-    if (!match(TokenRightParen)) {
+    if (increment != NULL) {
         int32 body_jump = emit_jump(OpJump);
         int32 increment_start = current_chunk()->count;
-        expression();
+        compile_expr(increment);
         emit_byte(OpPop);
-        consume(TokenRightParen, "Expect `)` after for clauses.");
 
         emit_loop(loop_start);
         loop_start = increment_start;
@@ -846,27 +2116,91 @@ static void for_statement() {
     statement();
     emit_loop(loop_start);
 
-    if (exit_jump != -1) {
-        patch_jump(exit_jump);
-        emit_byte(OpPop);
+    if (known == ConditionFalse) {
+        current->unreachable = unreachable;
+    } else if (known == ConditionTrue && vm.optimize) {
+        // Lox has no `break`, so nothing after an endless loop can run.
+        current->unreachable = true;
+    } else {
+        patch_condition(exit_jump);
+    }
+}
+
+static void for_statement() {
+    begin_scope();
+
+    consume(TokenLeftParen, "Expect `(` after `for.`");
+    int32 counter = -1;
+    if (match(TokenSemicolon)) {
+        // No initializer.
+    } else if (match(TokenVar)) {
+        var_declaration();
+        counter = current->local_count - 1;
+    } else {
+        expression_statement();
     }
 
+    int32 hoisted_count = hoist_loop_globals(1);
+
+    // The clauses are parsed up front and compiled once the shape of the
+    // loop is known, so their trees are kept until the loop is done.
+    ArenaMark mark = arena_mark(&ast_arena);
+    Expr* test = NULL;
+    if (!match(TokenSemicolon)) {
+        test = expression_tree();
+        consume(TokenSemicolon, "Expect `;` after loop condition.");
+    }
+    Expr* increment = NULL;
+    if (!match(TokenRightParen)) {
+        increment = expression_tree();
+        consume(TokenRightParen, "Expect `)` after for clauses.");
+    }
+
+    CountedLoop loop;
+    if (counted_loop(counter, test, increment, &loop)) {
+        counted_for(&loop, test, increment);
+    } else {
+        general_for(test, increment);
+    }
+
+    arena_release(&ast_arena, mark);
+    current->hoisted_count = hoisted_count;
     end_scope();
 }
 
+// Compiles a branch whose condition is known, dropping it if it can't be
+// taken.
+static void known_branch(bool taken) {
+    if (taken) {
+        statement();
+        return;
+    }
+
+    bool unreachable = current->unreachable;
+    current->unreachable = true;
+    statement();
+    current->unreachable = unreachable;
+}
+
 static void if_statement() {
     consume(TokenLeftParen, "Expect `(` after `if`.");
-    expression();
+    int32 then_jump;
+    Condition known = condition(&then_jump);
     consume(TokenRightParen, "Expect `)` after condition.");
 
-    int32 then_jump = emit_jump(OpJumpIfFalse);
-    emit_byte(OpPop);
+    if (known != ConditionUnknown) {
+        known_branch(known == ConditionTrue);
+        if (match(TokenElse)) {
+            known_branch(known == ConditionFalse);
+        }
+        return;
+    }
+
     statement();
 
     int32 else_jump = emit_jump(OpJump);
 
-    patch_jump(then_jump);
-    emit_byte(OpPop);
+    patch_condition(then_jump);
 
     if (match(TokenElse)) {
         statement();
@@ -881,7 +2215,62 @@ static void print_statement() {
     emit_byte(OpPrint);
 }
 
+// A returned call or method call reuses the current frame, so recursion
+// in tail form runs in constant stack space.
+static void compile_return_value(Expr* expr) {
+    if (expr->type != ExprCall && expr->type != ExprInvoke) {
+        compile_expr(expr);
+        return;
+    }
+
+    Token previous = parser.previous;
+    parser.previous.line = expr->line;
+    if (expr->type == ExprCall) {
+        compile_expr(expr->as.call.callee);
+        compile_arguments(expr->as.call.arguments, expr->as.call.arg_count);
+        emit_bytes(OpTailCall, expr->as.call.arg_count);
+    } else {
+        compile_expr(expr->as.property.object);
+        uint8 name = identifier_constant(&expr->as.property.name);
+        compile_arguments(expr->as.property.arguments, expr->as.property.arg_count);
+        emit_bytes(OpTailInvoke, name);
+        emit_byte(expr->as.property.arg_count);
+    }
+    parser.previous = previous;
+}
+
+static bool is_inlinable(Expr* expr, int32* budget) {
+    if (--*budget < 0) {
+        return false;
+    }
+    switch (expr->type) {
+        case ExprConstant: {
+            return true;
+        }
+        case ExprVariable: {
+            return expr->as.variable.get_op == OpGetLocal || expr->as.variable.get_op == OpGetGlobal;
+        }
+        case ExprUnary: {
+            return is_inlinable(expr->as.unary.operand, budget);
+        }
+        case ExprBinary:
+        case ExprLogical: {
+            return is_inlinable(expr->as.binary.left, budget) && is_inlinable(expr->as.binary.right, budget);
+        }
+        case ExprGet: {
+            return is_inlinable(expr->as.property.object, budget);
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
 static void return_statement() {
+    // Only a `return` that is a function's first statement can be inlined.
+    bool capture = current->capture_return;
+    current->capture_return = false;
+
     if (current->type == TypeScript) {
         error("Can't return from top-level code.");
     }
@@ -891,25 +2280,48 @@ static void return_statement() {
         if (current->type == TypeInitializer) {
             error("Can't return a value from an initializer.");
         }
-        expression();
+        ArenaMark mark = arena_mark(&ast_arena);
+        Expr* value = expression_tree();
         consume(TokenSemicolon, "Expect `;` after return value.");
+        int32 budget = INLINE_NODES_MAX;
+        if (capture && is_inlinable(value, &budget)) {
+            current->returned = copy_expr(&inline_arena, value, NULL);
+        }
+        compile_return_value(value);
         emit_byte(OpReturn);
+        arena_release(&ast_arena, mark);
+    }
+
+    if (vm.optimize) {
+        current->unreachable = true;
     }
 }
 
 static void while_statement() {
+    begin_scope();
+    int32 hoisted_count = hoist_loop_globals(0);
+
     int32 loop_start = current_chunk()->count;
     consume(TokenLeftParen, "Expect `(` after `while`.");
-    expression();
+    int32 exit_jump;
+    Condition known = condition(&exit_jump);
     consume(TokenRightParen, "Expect `)` after condition.");
 
-    int32 exit_jump = emit_jump(OpJumpIfFalse);
-    emit_byte(OpPop);
-    statement();
-    emit_loop(loop_start);
+    if (known == ConditionFalse) {
+        known_branch(false);
+    } else {
+        statement();
+        emit_loop(loop_start);
 
-    patch_jump(exit_jump);
-    emit_byte(OpPop);
+        if (known == ConditionTrue) {
+            current->unreachable = true;
+        } else {
+            patch_condition(exit_jump);
+        }
+    }
+
+    current->hoisted_count = hoisted_count;
+    end_scope();
 }
 
 static void synchronize() {
@@ -975,9 +2387,15 @@ static void statement() {
 }
 
 ObjFunction* compile(const char* source) {
+    if (vm.optimize) {
+        scan_assignments(source);
+    }
     init_scanner(source);
-    Compiler compiler;
-    init_compiler(&compiler, TypeScript);
+    init_arena(&compiler_arena);
+    init_arena(&ast_arena);
+    init_arena(&inline_arena);
+    inline_count = 0;
+    init_compiler(TypeScript);
     parser.had_error = false;
     parser.panic_mode = false;
 
@@ -988,6 +2406,9 @@ ObjFunction* compile(const char* source) {
     }
 
     ObjFunction* function = end_compiler();
+    free_arena(&compiler_arena);
+    free_arena(&ast_arena);
+    free_arena(&inline_arena);
 
     return parser.had_error ? NULL : function;
 }
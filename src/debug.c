@@ -29,6 +29,25 @@ static int32 invoke_instruction(const char* name, Chunk* chunk, int32 offset) {
     return offset + 3;
 }
 
+static int32 hoisted_instruction(const char* name, Chunk* chunk, int32 offset) {
+    uint8 slot = chunk->code[offset + 1];
+    uint8 constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d `", name, slot, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("`\n");
+    return offset + 3;
+}
+
+static int32 guard_instruction(const char* name, Chunk* chunk, int32 offset) {
+    uint8 constant = chunk->code[offset + 1];
+    uint16 jump = (uint16) (chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+    printf("%-16s %4d `", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("` -> %d\n", offset + 4 + jump);
+    return offset + 4;
+}
+
 static int32 simple_instruction(const char* name, int32 offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -47,6 +66,28 @@ static int32 jump_instruction(const char* name, int32 sign, Chunk* chunk, int32
     return offset + 3;
 }
 
+static int32 for_loop_instruction(const char* name, Chunk* chunk, int32 offset) {
+    static const char* comparisons[] = {"<", "<=", ">", ">="};
+    uint8 slot = chunk->code[offset + 1];
+    uint8 step = chunk->code[offset + 2];
+    uint8 bound = chunk->code[offset + 3];
+    uint8 mode = chunk->code[offset + 4];
+    uint16 jump = (uint16) (chunk->code[offset + 5] << 8);
+    jump |= chunk->code[offset + 6];
+    printf("%-16s %4d `", name, slot);
+    print_value(chunk->constants.values[step]);
+    printf("` %s ", comparisons[mode & ~ForLocalBound]);
+    if (mode & ForLocalBound) {
+        printf("%d", bound);
+    } else {
+        printf("`");
+        print_value(chunk->constants.values[bound]);
+        printf("`");
+    }
+    printf(" -> %d\n", offset + 7 - jump);
+    return offset + 7;
+}
+
 int32 disassemble_instruction(Chunk* chunk, int32 offset) {
     printf("%04d ", offset);
 
@@ -88,12 +129,21 @@ int32 disassemble_instruction(Chunk* chunk, int32 offset) {
         case OpSetGlobal: {
             return constant_instruction("SetGlobal", chunk, offset);
         }
+        case OpHoistGlobal: {
+            return constant_instruction("HoistGlobal", chunk, offset);
+        }
+        case OpGetHoisted: {
+            return hoisted_instruction("GetHoisted", chunk, offset);
+        }
         case OpGetUpvalue: {
             return byte_instruction("GetUpvalue", chunk, offset);
         }
         case OpSetUpvalue: {
             return byte_instruction("SetUpvalue", chunk, offset);
         }
+        case OpGetCopied: {
+            return byte_instruction("GetCopied", chunk, offset);
+        }
         case OpGetProperty: {
             return constant_instruction("GetProperty", chunk, offset);
         }
@@ -106,12 +156,21 @@ int32 disassemble_instruction(Chunk* chunk, int32 offset) {
         case OpEqual: {
             return simple_instruction("Equal", offset);
         }
+        case OpNotEqual: {
+            return simple_instruction("NotEqual", offset);
+        }
         case OpGreater: {
             return simple_instruction("Greater", offset);
         }
+        case OpGreaterEqual: {
+            return simple_instruction("GreaterEqual", offset);
+        }
         case OpLess: {
             return simple_instruction("Less", offset);
         }
+        case OpLessEqual: {
+            return simple_instruction("LessEqual", offset);
+        }
         case OpAdd: {
             return simple_instruction("Add", offset);
         }
@@ -124,12 +183,27 @@ int32 disassemble_instruction(Chunk* chunk, int32 offset) {
         case OpDivide: {
             return simple_instruction("Divide", offset);
         }
+        case OpAddNumber: {
+            return simple_instruction("AddNumber", offset);
+        }
+        case OpSubtractNumber: {
+            return simple_instruction("SubtractNumber", offset);
+        }
+        case OpMultiplyNumber: {
+            return simple_instruction("MultiplyNumber", offset);
+        }
+        case OpDivideNumber: {
+            return simple_instruction("DivideNumber", offset);
+        }
         case OpNot: {
             return simple_instruction("Not", offset);
         }
         case OpNegate: {
             return simple_instruction("Negate", offset);
         }
+        case OpNegateNumber: {
+            return simple_instruction("NegateNumber", offset);
+        }
         case OpPrint: {
             return simple_instruction("Print", offset);
         }
@@ -139,15 +213,36 @@ int32 disassemble_instruction(Chunk* chunk, int32 offset) {
         case OpJumpIfFalse: {
             return jump_instruction("JumpFalse", 1, chunk, offset);
         }
+        case OpJumpIfNotLess: {
+            return jump_instruction("JumpNotLess", 1, chunk, offset);
+        }
+        case OpJumpIfNotGreater: {
+            return jump_instruction("JumpNotGreater", 1, chunk, offset);
+        }
+        case OpJumpIfNotEqual: {
+            return jump_instruction("JumpNotEqual", 1, chunk, offset);
+        }
         case OpLoop: {
             return jump_instruction("Loop", -1, chunk, offset);
         }
+        case OpForLoop: {
+            return for_loop_instruction("ForLoop", chunk, offset);
+        }
         case OpCall: {
             return byte_instruction("Call", chunk, offset);
         }
+        case OpTailCall: {
+            return byte_instruction("TailCall", chunk, offset);
+        }
+        case OpInlineGuard: {
+            return guard_instruction("InlineGuard", chunk, offset);
+        }
         case OpInvoke: {
             return invoke_instruction("Invoke", chunk, offset);
         }
+        case OpTailInvoke: {
+            return invoke_instruction("TailInvoke", chunk, offset);
+        }
         case OpSuperInvoke: {
             return invoke_instruction("SuperInvoke", chunk, offset);
         }
@@ -164,6 +259,11 @@ int32 disassemble_instruction(Chunk* chunk, int32 offset) {
                 int32 index = chunk->code[offset++];
                 printf("%04d      |                     %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
             }
+            for (int32 j = 0; j < function->copied_count; j++) {
+                bool is_local = chunk->code[offset++] != 0;
+                int32 index = chunk->code[offset++];
+                printf("%04d      |                     copy %s %d\n", offset - 2, is_local ? "local" : "copied", index);
+            }
 
             return offset;
         }
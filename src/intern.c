@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Robin Hood hashing with backward-shift deletion, see table.c. A stored
+// hash of 0 marks an empty slot, so a real hash of 0 is stored as 1.
+#define INTERN_MIN_CAPACITY 64
+#define INTERN_MAX_LOAD 0.8
+#define INTERN_MIN_LOAD 0.2
+
+static inline uint32 stored_hash(uint32 hash) {
+    return hash == 0 ? 1 : hash;
+}
+
+static inline uint32 probe_distance(InternSet* set, uint32 index) {
+    return (index - set->hashes[index]) & (set->capacity - 1);
+}
+
+void init_intern_set(InternSet* set) {
+    set->count = 0;
+    set->capacity = 0;
+    set->shrink_pending = false;
+    set->hashes = NULL;
+    set->strings = NULL;
+}
+
+void free_intern_set(InternSet* set) {
+    FREE_ARRAY(uint32, set->hashes, set->capacity);
+    FREE_ARRAY(ObjString*, set->strings, set->capacity);
+    init_intern_set(set);
+}
+
+ObjString* intern_set_find(InternSet* set, const char* chars, int32 length, uint32 hash) {
+    if (set->count == 0) {
+        return NULL;
+    }
+
+    hash = stored_hash(hash);
+    uint32 mask = set->capacity - 1;
+    uint32 index = hash & mask;
+    for (uint32 distance = 0; ; distance++) {
+        uint32 slot_hash = set->hashes[index];
+        if (slot_hash == 0 || probe_distance(set, index) < distance) {
+            return NULL;
+        }
+        if (slot_hash == hash) {
+            ObjString* string = set->strings[index];
+            if (string->length == length && memcmp(string->chars, chars, length) == 0) {
+                return string;
+            }
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void insert_string(InternSet* set, uint32 hash, ObjString* string) {
+    uint32 mask = set->capacity - 1;
+    uint32 index = hash & mask;
+    uint32 distance = 0;
+
+    while (true) {
+        if (set->hashes[index] == 0) {
+            set->hashes[index] = hash;
+            set->strings[index] = string;
+            set->count++;
+            return;
+        }
+
+        uint32 existing = probe_distance(set, index);
+        if (existing < distance) {
+            uint32 displaced_hash = set->hashes[index];
+            ObjString* displaced = set->strings[index];
+            set->hashes[index] = hash;
+            set->strings[index] = string;
+            hash = displaced_hash;
+            string = displaced;
+            distance = existing;
+        }
+
+        index = (index + 1) & mask;
+        distance++;
+    }
+}
+
+static void adjust_capacity(InternSet* set, int32 capacity) {
+    usize size = (sizeof(uint32) + sizeof(ObjString*)) * capacity;
+    if (!heap_has_room(size)) {
+        out_of_memory_error(size);
+    }
+
+    InternSet resized;
+    init_intern_set(&resized);
+    resized.capacity = capacity;
+    resized.hashes = ALLOCATE(uint32, capacity);
+    resized.strings = ALLOCATE(ObjString*, capacity);
+    memset(resized.hashes, 0, sizeof(uint32) * capacity);
+
+    for (int32 i = 0; i < set->capacity; i++) {
+        if (set->hashes[i] != 0) {
+            insert_string(&resized, set->hashes[i], set->strings[i]);
+        }
+    }
+
+    free_intern_set(set);
+    *set = resized;
+}
+
+static int32 fitting_capacity(int32 count) {
+    int32 capacity = INTERN_MIN_CAPACITY;
+    while (count > capacity * INTERN_MAX_LOAD / 2) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+void intern_set_add(InternSet* set, ObjString* string) {
+    if (set->shrink_pending) {
+        set->shrink_pending = false;
+        int32 capacity = fitting_capacity(set->count + 1);
+        if (capacity < set->capacity) {
+            adjust_capacity(set, capacity);
+        }
+    }
+
+    if (set->count + 1 > set->capacity * INTERN_MAX_LOAD) {
+        int32 capacity = set->capacity < INTERN_MIN_CAPACITY ? INTERN_MIN_CAPACITY : set->capacity * 2;
+        adjust_capacity(set, capacity);
+    }
+
+    insert_string(set, stored_hash(string->hash), string);
+}
+
+static void remove_slot(InternSet* set, uint32 index) {
+    uint32 mask = set->capacity - 1;
+    uint32 next = (index + 1) & mask;
+
+    while (set->hashes[next] != 0 && probe_distance(set, next) != 0) {
+        set->hashes[index] = set->hashes[next];
+        set->strings[index] = set->strings[next];
+        index = next;
+        next = (next + 1) & mask;
+    }
+
+    set->hashes[index] = 0;
+    set->count--;
+}
+
+// Runs during collection, so it must not allocate. An underloaded set is
+// flagged and rebuilt smaller by the next intern_set_add().
+void intern_set_remove_white(InternSet* set) {
+    int32 i = 0;
+    while (i < set->capacity) {
+        if (set->hashes[i] != 0 && !set->strings[i]->obj.is_marked) {
+            remove_slot(set, (uint32) i);
+        } else {
+            i++;
+        }
+    }
+
+    if (set->capacity > INTERN_MIN_CAPACITY && set->count < set->capacity * INTERN_MIN_LOAD) {
+        set->shrink_pending = true;
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+
+// The set of interned strings. Each slot keeps the string's hash next to
+// the pointer, in separate arrays, so probing only touches the hashes and
+// mismatches never dereference the string.
+typedef struct {
+    int32 count;
+    int32 capacity;
+    bool shrink_pending;
+    uint32* hashes;
+    ObjString** strings;
+} InternSet;
+
+void init_intern_set(InternSet* set);
+void free_intern_set(InternSet* set);
+ObjString* intern_set_find(InternSet* set, const char* chars, int32 length, uint32 hash);
+void intern_set_add(InternSet* set, ObjString* string);
+void intern_set_remove_white(InternSet* set);
@@ -5,10 +5,142 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
+typedef enum {
+    ProfileNone,
+    ProfileText,
+    ProfileJson,
+} ProfileFormat;
+
+static bool show_gc_stats = false;
+static bool optimize = false;
+static ProfileFormat alloc_profile = ProfileNone;
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [-O] [--gc-stats] [--alloc-profile[=json]] [--heap-initial=SIZE] [--heap-grow=FACTOR] [--heap-min=SIZE] [--heap-max=SIZE] [path]\n");
+    exit(64);
+}
+
+static bool parse_size(const char* text, usize* size) {
+    char* end;
+    float64 value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return false;
+    }
+
+    switch (*end) {
+        case 'k':
+        case 'K': {
+            value *= 1024;
+            end++;
+            break;
+        }
+        case 'm':
+        case 'M': {
+            value *= 1024 * 1024;
+            end++;
+            break;
+        }
+        case 'g':
+        case 'G': {
+            value *= 1024 * 1024 * 1024;
+            end++;
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+    if (*end != '\0') {
+        return false;
+    }
+
+    *size = (usize) value;
+    return true;
+}
+
+static bool parse_factor(const char* text, float64* factor) {
+    char* end;
+    float64 value = strtod(text, &end);
+    if (end == text || *end != '\0' || value <= 1) {
+        return false;
+    }
+    *factor = value;
+    return true;
+}
+
+static bool set_heap_option(HeapConfig* config, const char* name, const char* value) {
+    if (strcmp(name, "initial") == 0) {
+        return parse_size(value, &config->initial_heap);
+    } else if (strcmp(name, "grow") == 0) {
+        return parse_factor(value, &config->grow_factor);
+    } else if (strcmp(name, "min") == 0) {
+        return parse_size(value, &config->min_heap);
+    } else if (strcmp(name, "max") == 0) {
+        return parse_size(value, &config->max_heap);
+    }
+    return false;
+}
+
+static void load_heap_env(HeapConfig* config) {
+    static const char* names[] = { "initial", "grow", "min", "max" };
+    static const char* variables[] = { "CLOX_HEAP_INITIAL", "CLOX_HEAP_GROW", "CLOX_HEAP_MIN", "CLOX_HEAP_MAX" };
+
+    for (int32 i = 0; i < 4; i++) {
+        const char* value = getenv(variables[i]);
+        if (value != NULL && !set_heap_option(config, names[i], value)) {
+            fprintf(stderr, "Invalid value \"%s\" for %s.\n", value, variables[i]);
+            exit(64);
+        }
+    }
+}
+
+static bool parse_heap_flag(HeapConfig* config, const char* arg) {
+    const char* prefix = "--heap-";
+    usize prefix_length = strlen(prefix);
+    if (strncmp(arg, prefix, prefix_length) != 0) {
+        return false;
+    }
+
+    const char* equals = strchr(arg, '=');
+    if (equals == NULL) {
+        usage();
+    }
+
+    char name[16];
+    usize name_length = equals - arg - prefix_length;
+    if (name_length >= sizeof(name)) {
+        usage();
+    }
+    memcpy(name, arg + prefix_length, name_length);
+    name[name_length] = '\0';
+
+    if (!set_heap_option(config, name, equals + 1)) {
+        fprintf(stderr, "Invalid option \"%s\".\n", arg);
+        exit(64);
+    }
+    return true;
+}
+
+static void exit_vm(int32 code) {
+    if (show_gc_stats) {
+        dump_gc_stats(stderr);
+    }
+    if (alloc_profile != ProfileNone) {
+        dump_alloc_profile(stderr, alloc_profile == ProfileJson);
+    }
+    if (code != 0) {
+        exit(code);
+    }
+    free_vm();
+}
+
 static void repl() {
     char line[1024];
+    vm.repl = true;
     while (true) {
         printf("> ");
 
@@ -55,25 +187,53 @@ static void run_file(const char* path) {
     free(source);
 
     if (result == InterpretCompileError) {
-        exit(65);
+        exit_vm(65);
     } else if (result == InterpretRuntimeError) {
-        exit(70);
+        exit_vm(70);
     }
 }
 
 int main(int argc, const char* argv[]) {
+    HeapConfig heap_config;
+    init_heap_config(&heap_config);
+    load_heap_env(&heap_config);
+
+    const char* path = NULL;
+    for (int32 i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O") == 0) {
+            optimize = true;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            show_gc_stats = true;
+        } else if (strcmp(argv[i], "--alloc-profile") == 0 || strcmp(argv[i], "--alloc-profile=text") == 0) {
+            alloc_profile = ProfileText;
+        } else if (strcmp(argv[i], "--alloc-profile=json") == 0) {
+            alloc_profile = ProfileJson;
+        } else if (parse_heap_flag(&heap_config, argv[i])) {
+            // Applied to heap_config.
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (heap_config.max_heap != 0 && heap_config.min_heap > heap_config.max_heap) {
+        fprintf(stderr, "Minimum heap size is larger than maximum heap size.\n");
+        exit(64);
+    }
+
     init_vm();
+    configure_heap(&heap_config);
+    vm.profile_allocations = alloc_profile != ProfileNone;
+    vm.optimize = optimize;
 
-    if (argc == 1) {
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        run_file(path);
     }
 
-    free_vm();
+    exit_vm(0);
 
     return 0;
 }
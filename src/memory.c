@@ -1,26 +1,70 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "compiler.h"
 #include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
+#define GC_HEAP_INITIAL (1024 * 1024)
 #define GC_HEAP_GROW_FACTOR 2
 
-void* reallocate(void* pointer, usize old_size, usize new_size) {
-    vm.bytes_allocated += new_size - old_size;
-    if (new_size > old_size) {
-        #ifdef DEBUG_STRESS_GC
+static const uint64 pause_bucket_bounds[GC_PAUSE_BUCKETS - 1] = {
+    10 * 1000,
+    100 * 1000,
+    1000 * 1000,
+    10 * 1000 * 1000,
+    100 * 1000 * 1000,
+};
+
+static const char* pause_bucket_names[GC_PAUSE_BUCKETS] = {
+    "lt_10us",
+    "lt_100us",
+    "lt_1ms",
+    "lt_10ms",
+    "lt_100ms",
+    "ge_100ms",
+};
+
+static void grow_heap(usize size) {
+    vm.bytes_allocated += size;
+
+    #ifdef DEBUG_STRESS_GC
+    collect_garbage();
+    #endif
+
+    if (vm.bytes_allocated > vm.next_gc) {
         collect_garbage();
-        #endif
+    }
 
-        if (vm.bytes_allocated > vm.next_gc) {
-            collect_garbage();
-        }
+    // next_gc never exceeds max_heap, so a full collection has just run.
+    if (vm.heap_config.max_heap != 0 && vm.bytes_allocated > vm.heap_config.max_heap) {
+        vm.bytes_allocated -= size;
+        out_of_memory_error(size);
+    }
+}
+
+// Checks that `size` more bytes fit under the heap limit, collecting first
+// if they would not. A caller holding memory that no object owns yet calls
+// this before its next allocations, so it can free that memory instead of
+// leaking it when the error unwinds.
+bool heap_has_room(usize size) {
+    if (vm.bytes_allocated + size > vm.next_gc) {
+        collect_garbage();
+    }
+    return vm.heap_config.max_heap == 0 || vm.bytes_allocated + size <= vm.heap_config.max_heap;
+}
+
+void* reallocate(void* pointer, usize old_size, usize new_size) {
+    if (new_size > old_size) {
+        grow_heap(new_size - old_size);
+    } else {
+        vm.bytes_allocated -= old_size - new_size;
     }
     if (new_size == 0) {
         free(pointer);
@@ -29,11 +73,149 @@ void* reallocate(void* pointer, usize old_size, usize new_size) {
 
     void* result = realloc(pointer, new_size);
     if (result == NULL) {
-        exit(1);
+        vm.bytes_allocated -= new_size - old_size;
+        out_of_memory_error(new_size - old_size);
+    }
+    return result;
+}
+
+static usize arena_align(usize size) {
+    return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+void init_arena(Arena* arena) {
+    arena->current = NULL;
+    arena->last = NULL;
+}
+
+void* arena_allocate(Arena* arena, usize size) {
+    size = arena_align(size);
+    ArenaBlock* block = arena->current;
+    if (block == NULL || block->used + size > block->capacity) {
+        usize capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + capacity);
+        if (block == NULL) {
+            out_of_memory_error(capacity);
+        }
+        block->previous = arena->current;
+        block->capacity = capacity;
+        block->used = 0;
+        arena->current = block;
     }
+
+    void* result = block->data + block->used;
+    block->used += size;
+    arena->last = result;
     return result;
 }
 
+void* arena_grow(Arena* arena, void* pointer, usize old_size, usize new_size) {
+    ArenaBlock* block = arena->current;
+    if (pointer != NULL && pointer == arena->last) {
+        usize offset = (usize) ((uint8*) pointer - block->data);
+        if (offset + arena_align(new_size) <= block->capacity) {
+            block->used = offset + arena_align(new_size);
+            return pointer;
+        }
+    }
+
+    void* result = arena_allocate(arena, new_size);
+    if (pointer != NULL) {
+        memcpy(result, pointer, old_size);
+    }
+    return result;
+}
+
+ArenaMark arena_mark(Arena* arena) {
+    ArenaMark mark;
+    mark.block = arena->current;
+    mark.used = arena->current != NULL ? arena->current->used : 0;
+    return mark;
+}
+
+void arena_release(Arena* arena, ArenaMark mark) {
+    while (arena->current != mark.block) {
+        ArenaBlock* previous = arena->current->previous;
+        free(arena->current);
+        arena->current = previous;
+    }
+    if (arena->current != NULL) {
+        arena->current->used = mark.used;
+    }
+    arena->last = NULL;
+}
+
+void free_arena(Arena* arena) {
+    ArenaMark empty = { NULL, 0 };
+    arena_release(arena, empty);
+}
+
+static ObjPool* object_pool(ObjType type) {
+    switch (type) {
+        case ObjectBoundMethod: {
+            return &vm.bound_method_pool;
+        }
+        case ObjectUpvalue: {
+            return &vm.upvalue_pool;
+        }
+        default: {
+            return NULL;
+        }
+    }
+}
+
+void init_pool(ObjPool* pool) {
+    pool->free_list = NULL;
+    pool->count = 0;
+    pool->hits = 0;
+    pool->misses = 0;
+}
+
+Obj* reuse_object(ObjType type, usize size) {
+    ObjPool* pool = object_pool(type);
+    if (pool == NULL) {
+        return NULL;
+    }
+    if (pool->free_list == NULL) {
+        pool->misses++;
+        return NULL;
+    }
+
+    // A recycled object still counts as an allocation for GC pacing. The
+    // collection this may start only ever adds objects to the pool.
+    grow_heap(size);
+
+    Obj* object = pool->free_list;
+    pool->free_list = object->next;
+    pool->count--;
+    pool->hits++;
+    return object;
+}
+
+static void recycle_object(Obj* object, usize size) {
+    ObjPool* pool = object_pool(object->type);
+    if (pool->count >= OBJ_POOL_MAX) {
+        reallocate(object, size, 0);
+        return;
+    }
+
+    vm.bytes_allocated -= size;
+    object->next = pool->free_list;
+    pool->free_list = object;
+    pool->count++;
+}
+
+static void free_pool(ObjPool* pool) {
+    Obj* object = pool->free_list;
+    while (object != NULL) {
+        Obj* next = object->next;
+        free(object);
+        object = next;
+    }
+    pool->free_list = NULL;
+    pool->count = 0;
+}
+
 void mark_object(Obj* object) {
     if (object == NULL || object->is_marked) {
         return;
@@ -70,6 +252,20 @@ static void mark_array(ValueArray* array) {
     }
 }
 
+// Views do not mark their parent while tracing. settle_views() decides
+// afterwards which parents are worth keeping.
+static void defer_view(ObjString* view) {
+    if (vm.view_capacity < vm.view_count + 1) {
+        vm.view_capacity = GROW_CAPACITY(vm.view_capacity);
+        vm.views = (ObjString**) realloc(vm.views, sizeof(ObjString*) * vm.view_capacity);
+        if (vm.views == NULL) {
+            exit(1);
+        }
+    }
+
+    vm.views[vm.view_count++] = view;
+}
+
 static void blacken_object(Obj* object) {
     #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*) object);
@@ -96,6 +292,9 @@ static void blacken_object(Obj* object) {
             for (int32 i = 0; i < closure->upvalue_count; i++) {
                 mark_object((Obj*) closure->upvalues[i]);
             }
+            for (int32 i = 0; i < closure->copied_count; i++) {
+                mark_value(closure->copied[i]);
+            }
             break;
         }
         case ObjectFunction: {
@@ -110,63 +309,106 @@ static void blacken_object(Obj* object) {
             mark_table(&instance->fields);
             break;
         }
+        case ObjectRope: {
+            ObjRope* rope = (ObjRope*) object;
+            mark_value(rope->left);
+            mark_value(rope->right);
+            mark_object((Obj*) rope->flat);
+            break;
+        }
         case ObjectUpvalue: {
             mark_value(((ObjUpvalue*) object)->closed);
             break;
         }
-        case ObjectNative:
         case ObjectString: {
+            ObjString* string = (ObjString*) object;
+            if (string->parent != NULL) {
+                defer_view(string);
+            }
+            break;
+        }
+        case ObjectNative: {
             break;
         }
     }
 }
 
+static void untrack_object(ObjType type, usize size) {
+    vm.gc_stats.live_objects[type]--;
+    vm.gc_stats.live_bytes[type] -= size;
+}
+
 static void free_object(Obj* object) {
     #ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*) object, object->type);
     #endif
 
+    if (vm.profile_allocations) {
+        profile_free(object);
+    }
+
     switch (object->type) {
         case ObjectBoundMethod: {
-            FREE(ObjBoundMethod, object);
+            untrack_object(ObjectBoundMethod, sizeof(ObjBoundMethod));
+            recycle_object(object, sizeof(ObjBoundMethod));
             break;
         }
         case ObjectClass: {
             ObjClass* class = (ObjClass*) object;
+            untrack_object(ObjectClass, sizeof(ObjClass));
             free_table(&class->methods);
             FREE(ObjClass, object);
             break;
         }
         case ObjectClosure: {
             ObjClosure* closure = (ObjClosure*) object;
+            usize size = sizeof(ObjClosure) + sizeof(Value) * closure->copied_count;
+            untrack_object(ObjectClosure, size);
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, object);
+            reallocate(object, size, 0);
             break;
         }
         case ObjectFunction: {
             ObjFunction* function = (ObjFunction*) object;
+            untrack_object(ObjectFunction, sizeof(ObjFunction));
+            if (vm.profile_allocations) {
+                profile_forget_function(function);
+            }
             free_chunk(&function->chunk);
             FREE(ObjFunction, object);
             break;
         }
         case ObjectInstance: {
             ObjInstance* instance = (ObjInstance*) object;
+            untrack_object(ObjectInstance, sizeof(ObjInstance));
             free_table(&instance->fields);
             FREE(ObjInstance, instance);
             break;
         }
         case ObjectNative: {
+            untrack_object(ObjectNative, sizeof(ObjNative));
             FREE(ObjNative, object);
             break;
         }
+        case ObjectRope: {
+            untrack_object(ObjectRope, sizeof(ObjRope));
+            FREE(ObjRope, object);
+            break;
+        }
         case ObjectString: {
             ObjString* string = (ObjString*) object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
+            if (string->parent != NULL) {
+                untrack_object(ObjectString, sizeof(ObjString));
+            } else {
+                untrack_object(ObjectString, sizeof(ObjString) + string->length + 1);
+                FREE_ARRAY(char, string->chars, string->length + 1);
+            }
             FREE(ObjString, object);
             break;
         }
         case ObjectUpvalue: {
-            FREE(ObjUpvalue, object);
+            untrack_object(ObjectUpvalue, sizeof(ObjUpvalue));
+            recycle_object(object, sizeof(ObjUpvalue));
             break;
         }
     }
@@ -175,6 +417,11 @@ static void free_object(Obj* object) {
 static void mark_roots() {
     for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
         mark_value(*slot);
+        // A native may be reading a view on the stack, so it is never
+        // detached from its parent mid-call.
+        if (is_string(*slot) && as_string(*slot)->parent != NULL) {
+            mark_object((Obj*) as_string(*slot)->parent);
+        }
     }
 
     for (int32 i = 0; i < vm.frame_count; i++) {
@@ -188,6 +435,8 @@ static void mark_roots() {
     mark_table(&vm.globals);
     mark_compiler_roots();
     mark_object((Obj*) vm.init_string);
+    mark_object((Obj*) vm.gc_stats_class);
+    mark_object((Obj*) vm.string_list_class);
 }
 
 static void trace_references() {
@@ -197,11 +446,52 @@ static void trace_references() {
     }
 }
 
+// A parent that is only reachable through views stays alive if one of
+// them covers at least 1 / VIEW_KEEP_RATIO of it. Smaller views get their
+// own copy of their bytes instead, so a short slice cannot pin a large
+// string. The copy bypasses reallocate() because a collection is running.
+#define VIEW_KEEP_RATIO 4
+
+static bool detach_view(ObjString* view) {
+    char* chars = (char*) malloc(view->length + 1);
+    if (chars == NULL) {
+        return false;
+    }
+    memcpy(chars, view->chars, view->length);
+    chars[view->length] = '\0';
+    view->chars = chars;
+    view->parent = NULL;
+    vm.bytes_allocated += view->length + 1;
+    vm.gc_stats.live_bytes[ObjectString] += view->length + 1;
+    return true;
+}
+
+static void settle_views() {
+    for (int32 i = 0; i < vm.view_count; i++) {
+        ObjString* view = vm.views[i];
+        if ((usize) view->length * VIEW_KEEP_RATIO >= (usize) view->parent->length) {
+            view->parent->obj.is_marked = true;
+        }
+    }
+
+    for (int32 i = 0; i < vm.view_count; i++) {
+        ObjString* view = vm.views[i];
+        if (!view->parent->obj.is_marked && !detach_view(view)) {
+            view->parent->obj.is_marked = true;
+        }
+    }
+
+    vm.view_count = 0;
+}
+
 static void sweep() {
     Obj* previous = NULL;
     Obj* object = vm.objects;
     while (object != NULL) {
         if (object->is_marked) {
+            if (vm.profile_allocations) {
+                profile_survivor(object);
+            }
             object->is_marked = false;
             previous = object;
             object = object->next;
@@ -218,18 +508,59 @@ static void sweep() {
     }
 }
 
+static usize clamp_heap_size(usize size) {
+    HeapConfig* config = &vm.heap_config;
+    if (size < config->min_heap) {
+        size = config->min_heap;
+    }
+    if (config->max_heap != 0 && size > config->max_heap) {
+        size = config->max_heap;
+    }
+    return size;
+}
+
+static uint64 now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64) time.tv_sec * 1000000000 + (uint64) time.tv_nsec;
+}
+
+static void record_collection(uint64 pause_ns, usize freed) {
+    GcStats* stats = &vm.gc_stats;
+
+    stats->pause_total_ns += pause_ns;
+    if (pause_ns > stats->pause_max_ns) {
+        stats->pause_max_ns = pause_ns;
+    }
+
+    int32 bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && pause_ns >= pause_bucket_bounds[bucket]) {
+        bucket++;
+    }
+    stats->pause_histogram[bucket]++;
+
+    stats->bytes_freed += freed;
+    stats->next_gc_history[stats->collections % GC_HISTORY_MAX] = vm.next_gc;
+    stats->collections++;
+}
+
 void collect_garbage() {
     #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    usize before = vm.bytes_allocated;
     #endif
 
+    usize before = vm.bytes_allocated;
+    uint64 start = now_ns();
+
     mark_roots();
     trace_references();
-    table_remove_white(&vm.strings);
+    settle_views();
+    intern_set_remove_white(&vm.strings);
     sweep();
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    vm.next_gc = clamp_heap_size((usize) (vm.bytes_allocated * vm.heap_config.grow_factor));
+
+    record_collection(now_ns() - start, before - vm.bytes_allocated);
 
     #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -244,5 +575,87 @@ void free_objects() {
         free_object(object);
         object = next;
     }
+    free_pool(&vm.bound_method_pool);
+    free_pool(&vm.upvalue_pool);
     free(vm.gray_stack);
+    free(vm.views);
+}
+
+void init_heap_config(HeapConfig* config) {
+    config->initial_heap = GC_HEAP_INITIAL;
+    config->grow_factor = GC_HEAP_GROW_FACTOR;
+    config->min_heap = 0;
+    config->max_heap = 0;
+}
+
+void configure_heap(HeapConfig* config) {
+    vm.heap_config = *config;
+    vm.next_gc = clamp_heap_size(config->initial_heap);
+}
+
+void init_gc_stats(GcStats* stats) {
+    stats->collections = 0;
+    stats->pause_total_ns = 0;
+    stats->pause_max_ns = 0;
+    for (int32 i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        stats->pause_histogram[i] = 0;
+    }
+    stats->bytes_freed = 0;
+    for (int32 i = 0; i < OBJ_TYPE_COUNT; i++) {
+        stats->live_objects[i] = 0;
+        stats->live_bytes[i] = 0;
+    }
+    for (int32 i = 0; i < GC_HISTORY_MAX; i++) {
+        stats->next_gc_history[i] = 0;
+    }
+}
+
+const char* gc_pause_bucket_name(int32 bucket) {
+    return pause_bucket_names[bucket];
+}
+
+float64 pool_hit_rate(ObjPool* pool) {
+    uint64 requests = pool->hits + pool->misses;
+    return requests == 0 ? 0 : (float64) pool->hits / (float64) requests;
+}
+
+static void print_pool_stats(FILE* file, const char* name, ObjPool* pool, const char* separator) {
+    fprintf(file, "    \"%s\": { \"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.4f, \"free\": %d }%s\n", name, (unsigned long long) pool->hits, (unsigned long long) pool->misses, pool_hit_rate(pool), pool->count, separator);
+}
+
+void dump_gc_stats(FILE* file) {
+    GcStats* stats = &vm.gc_stats;
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"collections\": %d,\n", stats->collections);
+    fprintf(file, "  \"bytes_allocated\": %zu,\n", vm.bytes_allocated);
+    fprintf(file, "  \"bytes_freed\": %zu,\n", stats->bytes_freed);
+    fprintf(file, "  \"next_gc\": %zu,\n", vm.next_gc);
+    fprintf(file, "  \"pause_total_ns\": %llu,\n", (unsigned long long) stats->pause_total_ns);
+    fprintf(file, "  \"pause_max_ns\": %llu,\n", (unsigned long long) stats->pause_max_ns);
+
+    fprintf(file, "  \"pause_histogram\": {");
+    for (int32 i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        fprintf(file, "%s\"%s\": %d", i == 0 ? " " : ", ", pause_bucket_names[i], stats->pause_histogram[i]);
+    }
+    fprintf(file, " },\n");
+
+    fprintf(file, "  \"live\": {\n");
+    for (int32 i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(file, "    \"%s\": { \"objects\": %d, \"bytes\": %zu }%s\n", obj_type_name((ObjType) i), stats->live_objects[i], stats->live_bytes[i], i == OBJ_TYPE_COUNT - 1 ? "" : ",");
+    }
+    fprintf(file, "  },\n");
+
+    fprintf(file, "  \"pools\": {\n");
+    print_pool_stats(file, "bound_method", &vm.bound_method_pool, ",");
+    print_pool_stats(file, "upvalue", &vm.upvalue_pool, "");
+    fprintf(file, "  },\n");
+
+    int32 first = stats->collections > GC_HISTORY_MAX ? stats->collections - GC_HISTORY_MAX : 0;
+    fprintf(file, "  \"next_gc_history\": [");
+    for (int32 i = first; i < stats->collections; i++) {
+        fprintf(file, "%s%zu", i == first ? "" : ", ", stats->next_gc_history[i % GC_HISTORY_MAX]);
+    }
+    fprintf(file, "]\n");
+    fprintf(file, "}\n");
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
@@ -13,9 +15,78 @@
     (type*) reallocate(pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
 #define FREE_ARRAY(type, pointer, old_count) \
     reallocate(pointer, sizeof(type) * (old_count), 0)
+#define ARENA_ALLOCATE(arena, type, count) \
+    (type*) arena_allocate(arena, sizeof(type) * (count))
+#define ARENA_GROW_ARRAY(arena, type, pointer, old_count, new_count) \
+    (type*) arena_grow(arena, pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
+
+#define GC_PAUSE_BUCKETS 6
+#define GC_HISTORY_MAX 32
+
+typedef struct {
+    usize initial_heap;
+    float64 grow_factor;
+    usize min_heap;
+    usize max_heap;
+} HeapConfig;
+
+#define OBJ_POOL_MAX 1024
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* previous;
+    usize capacity;
+    usize used;
+    uint8 data[];
+} ArenaBlock;
+
+// Scratch memory that is released in bulk. It is not counted in
+// vm.bytes_allocated and never triggers a collection.
+typedef struct Arena {
+    ArenaBlock* current;
+    void* last;
+} Arena;
+
+typedef struct {
+    ArenaBlock* block;
+    usize used;
+} ArenaMark;
+
+typedef struct {
+    Obj* free_list;
+    int32 count;
+    uint64 hits;
+    uint64 misses;
+} ObjPool;
+
+typedef struct {
+    int32 collections;
+    uint64 pause_total_ns;
+    uint64 pause_max_ns;
+    int32 pause_histogram[GC_PAUSE_BUCKETS];
+    usize bytes_freed;
+    int32 live_objects[OBJ_TYPE_COUNT];
+    usize live_bytes[OBJ_TYPE_COUNT];
+    usize next_gc_history[GC_HISTORY_MAX];
+} GcStats;
 
+bool heap_has_room(usize size);
 void* reallocate(void* pointer, usize old_size, usize new_size);
+void init_arena(Arena* arena);
+void* arena_allocate(Arena* arena, usize size);
+void* arena_grow(Arena* arena, void* pointer, usize old_size, usize new_size);
+ArenaMark arena_mark(Arena* arena);
+void arena_release(Arena* arena, ArenaMark mark);
+void free_arena(Arena* arena);
+void init_pool(ObjPool* pool);
+Obj* reuse_object(ObjType type, usize size);
 void mark_object(Obj* object);
 void mark_value(Value value);
 void collect_garbage();
 void free_objects();
+void init_heap_config(HeapConfig* config);
+void configure_heap(HeapConfig* config);
+void init_gc_stats(GcStats* stats);
+const char* gc_pause_bucket_name(int32 bucket);
+float64 pool_hit_rate(ObjPool* pool);
+void dump_gc_stats(FILE* file);
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -11,12 +14,20 @@
     (type*) allocate_object(sizeof(type), object_type)
 
 static Obj* allocate_object(usize size, ObjType type) {
-    Obj* object = (Obj*) reallocate(NULL, 0, size);
+    Obj* object = reuse_object(type, size);
+    if (object == NULL) {
+        object = (Obj*) reallocate(NULL, 0, size);
+    }
     object->type = type;
     object->is_marked = false;
+    object->has_survived = false;
+    object->alloc_site = vm.profile_allocations ? profile_allocation(type, size) : 0;
     object->next = vm.objects;
     vm.objects = object;
 
+    vm.gc_stats.live_objects[type]++;
+    vm.gc_stats.live_bytes[type] += size;
+
     #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*) object, size, type);
     #endif
@@ -39,22 +50,35 @@ ObjClass* new_class(ObjString* name) {
 }
 
 ObjClosure* new_closure(ObjFunction* function) {
+    usize size = sizeof(ObjClosure) + sizeof(Value) * function->copied_count;
+    usize upvalues_size = sizeof(ObjUpvalue*) * function->upvalue_count;
+    if (!heap_has_room(size + upvalues_size)) {
+        out_of_memory_error(size + upvalues_size);
+    }
+
     ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
     for (int32 i = 0; i < function->upvalue_count; i++) {
         upvalues[i] = NULL;
     }
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, ObjectClosure);
+    ObjClosure* closure = (ObjClosure*) allocate_object(size, ObjectClosure);
     closure->function = function;
     closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
+    closure->copied_count = function->copied_count;
+    for (int32 i = 0; i < function->copied_count; i++) {
+        closure->copied[i] = nil_val();
+    }
     return closure;
 }
 
 ObjFunction* new_function() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, ObjectFunction);
     function->arity = 0;
+    function->lifted = 0;
     function->upvalue_count = 0;
+    function->copied_count = 0;
     function->name = NULL;
+    function->getter = NULL;
     init_chunk(&function->chunk);
     return function;
 }
@@ -72,18 +96,84 @@ ObjNative* new_native(NativeFn function) {
     return native;
 }
 
+static inline int32 rope_depth(Value value) {
+    return is_rope(value) ? as_rope(value)->depth : 0;
+}
+
+// A flattened rope stands in for its string, so new ropes never link to
+// halves that are about to be dropped.
+static inline Value rope_part(Value value) {
+    if (is_rope(value) && as_rope(value)->flat != NULL) {
+        return obj_val((Obj*) as_rope(value)->flat);
+    }
+    return value;
+}
+
+// `depth` counts right turns only: flattening loops down the left spine
+// and recurses into right halves, so appending in a loop stays at depth 1.
+ObjRope* new_rope(Value left, Value right) {
+    left = rope_part(left);
+    right = rope_part(right);
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, ObjectRope);
+    rope->length = string_value_length(left) + string_value_length(right);
+    rope->depth = rope_depth(left) > rope_depth(right) + 1 ? rope_depth(left) : rope_depth(right) + 1;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return rope;
+}
+
+// Copies `value` so that it ends at `end`.
+static void copy_rope(Value value, char* end) {
+    value = rope_part(value);
+    while (is_rope(value)) {
+        ObjRope* rope = as_rope(value);
+        copy_rope(rope->right, end);
+        end -= string_value_length(rope->right);
+        value = rope_part(rope->left);
+    }
+    StringChars chars;
+    string_value_chars(value, &chars);
+    memcpy(end - chars.length, chars.chars, chars.length);
+}
+
+ObjString* flatten_rope(ObjRope* rope) {
+    if (rope->flat == NULL) {
+        char* chars = ALLOCATE(char, rope->length + 1);
+        copy_rope(obj_val((Obj*) rope), chars + rope->length);
+        chars[rope->length] = '\0';
+        rope->flat = take_string(chars, rope->length);
+        rope->left = nil_val();
+        rope->right = nil_val();
+    }
+    return rope->flat;
+}
+
 static ObjString* allocate_string(char* chars, int32 length, uint32 hash) {
+    if (!heap_has_room(sizeof(ObjString))) {
+        FREE_ARRAY(char, chars, length + 1);
+        out_of_memory_error(sizeof(ObjString));
+    }
     ObjString* string = ALLOCATE_OBJ(ObjString, ObjectString);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    push(obj_val((Obj*) string));
-    table_set(&vm.strings, string, nil_val());
-    pop();
+    string->parent = NULL;
+    vm.gc_stats.live_bytes[ObjectString] += length + 1;
+    profile_add_bytes(string->obj.alloc_site, length + 1);
+    if (hash != 0) {
+        push(obj_val((Obj*) string));
+        intern_set_add(&vm.strings, string);
+        pop();
+    }
     return string;
 }
 
-static uint32 hash_string(const char* key, int32 length) {
+#ifdef STRING_HASH_FNV
+
+void seed_string_hash() {}
+
+uint32 hash_string(const char* key, int32 length) {
     uint32 hash = 2166136261;
     for (int32 i = 0; i < length; i++) {
         hash ^= (uint8) key[i];
@@ -92,22 +182,100 @@ static uint32 hash_string(const char* key, int32 length) {
     return hash;
 }
 
-ObjString* take_string(char* chars, int32 length) {
+#else
+
+// Keyed multiply-fold hash over 8-byte words. The key is drawn once per
+// process, so which strings collide cannot be worked out in advance.
+static uint64 hash_key[2] = { 0x2d358dccaa6c78a5, 0x8bb84b93962eacc9 };
+
+void seed_string_hash() {
+    FILE* random = fopen("/dev/urandom", "rb");
+    if (random != NULL) {
+        usize read = fread(hash_key, sizeof(hash_key), 1, random);
+        fclose(random);
+        if (read == 1) {
+            return;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    hash_key[0] ^= (uint64) now.tv_nsec * 0x9e3779b97f4a7c15 ^ (uint64) now.tv_sec;
+    hash_key[1] ^= (uint64) (uintptr) &now * 0xff51afd7ed558ccd;
+}
+
+static inline uint64 fold_multiply(uint64 a, uint64 b) {
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64) product ^ (uint64) (product >> 64);
+}
+
+static inline uint64 read_64(const char* bytes) {
+    uint64 word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline uint64 read_32(const char* bytes) {
+    uint32 word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// Packs the last 1 to 7 bytes into a word. Lengths 4 to 7 use two
+// overlapping 4-byte reads, shorter tails pick out the first, middle and
+// last bytes.
+static inline uint64 read_tail(const char* bytes, int32 count) {
+    if (count >= 4) {
+        return read_32(bytes) << 32 | read_32(bytes + count - 4);
+    }
+    return (uint64) (uint8) bytes[0] << 16 | (uint64) (uint8) bytes[count / 2] << 8 | (uint8) bytes[count - 1];
+}
+
+uint32 hash_string(const char* key, int32 length) {
+    uint64 hash = hash_key[0] ^ (uint64) length;
+    int32 i = 0;
+    for (; i + 8 <= length; i += 8) {
+        hash = fold_multiply(read_64(key + i) ^ hash_key[1], hash ^ hash_key[0]);
+    }
+    if (i < length) {
+        hash = fold_multiply(read_tail(key + i, length - i) ^ hash_key[1], hash ^ hash_key[0]);
+    }
+    hash = fold_multiply(hash ^ hash_key[1], hash_key[0] ^ 0xe7037ed1a0b428db);
+    return (uint32) (hash ^ (hash >> 32));
+}
+
+#endif
+
+// A hash of 0 marks a string that has not been interned.
+static inline uint32 intern_hash(const char* chars, int32 length) {
     uint32 hash = hash_string(chars, length);
+    return hash != 0 ? hash : 1;
+}
+
+ObjString* take_string(char* chars, int32 length) {
+    #ifdef STRING_EAGER_INTERN
 
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    uint32 hash = intern_hash(chars, length);
+
+    ObjString* interned = intern_set_find(&vm.strings, chars, length, hash);
     if (interned != NULL) {
         FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
 
     return allocate_string(chars, length, hash);
+
+    #else
+
+    return allocate_string(chars, length, 0);
+
+    #endif
 }
 
 ObjString* copy_string(const char* chars, int32 length) {
-    uint32 hash = hash_string(chars, length);
+    uint32 hash = intern_hash(chars, length);
 
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString* interned = intern_set_find(&vm.strings, chars, length, hash);
     if (interned != NULL) {
         return interned;
     }
@@ -118,6 +286,74 @@ ObjString* copy_string(const char* chars, int32 length) {
     return allocate_string(heap_chars, length, hash);
 }
 
+// Slices shorter than this are copied, which costs about as much as a view
+// and does not keep the parent alive.
+#define VIEW_MIN_LENGTH 16
+
+ObjString* new_view(ObjString* string, int32 start, int32 length) {
+    if (length < VIEW_MIN_LENGTH) {
+        return copy_string(string->chars + start, length);
+    }
+
+    ObjString* view = ALLOCATE_OBJ(ObjString, ObjectString);
+    ObjString* parent = string->parent != NULL ? string->parent : string;
+    start += (int32) (string->chars - parent->chars);
+    view->length = length;
+    view->chars = parent->chars + start;
+    view->hash = 0;
+    view->parent = parent;
+    return view;
+}
+
+Value copy_string_value(const char* chars, int32 length) {
+    #ifdef NAN_BOXING
+    if (fits_short_string(length)) {
+        return short_string_val(chars, length);
+    }
+    #endif
+    return obj_val((Obj*) copy_string(chars, length));
+}
+
+Value take_string_value(char* chars, int32 length) {
+    if (fits_short_string(length)) {
+        Value value = copy_string_value(chars, length);
+        FREE_ARRAY(char, chars, length + 1);
+        return value;
+    }
+    return obj_val((Obj*) take_string(chars, length));
+}
+
+Value slice_string_value(StringChars* chars, int32 start, int32 length) {
+    if (fits_short_string(length)) {
+        return copy_string_value(chars->chars + start, length);
+    }
+    return obj_val((Obj*) new_view(chars->string, start, length));
+}
+
+int32 string_value_length(Value value) {
+    #ifdef NAN_BOXING
+    if (is_short_string(value)) {
+        return short_string_length(value);
+    }
+    #endif
+    return is_rope(value) ? as_rope(value)->length : as_string(value)->length;
+}
+
+void string_value_chars(Value value, StringChars* chars) {
+    #ifdef NAN_BOXING
+    if (is_short_string(value)) {
+        short_string_chars(value, chars->buffer);
+        chars->string = NULL;
+        chars->chars = chars->buffer;
+        chars->length = short_string_length(value);
+        return;
+    }
+    #endif
+    chars->string = as_string(value);
+    chars->chars = chars->string->chars;
+    chars->length = chars->string->length;
+}
+
 ObjUpvalue* new_upvalue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, ObjectUpvalue);
     upvalue->closed = nil_val();
@@ -126,6 +362,39 @@ ObjUpvalue* new_upvalue(Value* slot) {
     return upvalue;
 }
 
+const char* obj_type_name(ObjType type) {
+    switch (type) {
+        case ObjectBoundMethod: {
+            return "bound_method";
+        }
+        case ObjectClass: {
+            return "class";
+        }
+        case ObjectClosure: {
+            return "closure";
+        }
+        case ObjectFunction: {
+            return "function";
+        }
+        case ObjectInstance: {
+            return "instance";
+        }
+        case ObjectNative: {
+            return "native";
+        }
+        case ObjectRope: {
+            return "rope";
+        }
+        case ObjectString: {
+            return "string";
+        }
+        case ObjectUpvalue: {
+            return "upvalue";
+        }
+    }
+    return "unknown";  // Unreachable.
+}
+
 static void print_function(ObjFunction* function) {
     if (function->name == NULL) {
         printf("<script>");
@@ -160,8 +429,18 @@ void print_object(Value value) {
             printf("<native fn>");
             break;
         }
+        case ObjectRope: {
+            // Printing must not allocate, so an unflattened rope only shows its length.
+            ObjRope* rope = as_rope(value);
+            if (rope->flat != NULL) {
+                printf("%s", rope->flat->chars);
+            } else {
+                printf("<rope of %d chars>", rope->length);
+            }
+            break;
+        }
         case ObjectString: {
-            printf("%s", as_cstring(value));
+            printf("%.*s", as_string(value)->length, as_cstring(value));
             break;
         }
         case ObjectUpvalue: {
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string.h>
+
 #include "common.h"
 #include "chunk.h"
 #include "table.h"
@@ -12,22 +14,30 @@ typedef enum {
     ObjectFunction,
     ObjectInstance,
     ObjectNative,
+    ObjectRope,
     ObjectString,
     ObjectUpvalue,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (ObjectUpvalue + 1)
+
 struct Obj {
     ObjType type;
     bool is_marked;
+    bool has_survived;
+    uint16 alloc_site;
     struct Obj* next;
 };
 
 typedef struct {
     Obj obj;
     int32 arity;
+    int32 lifted;  // Trailing parameters the compiler added, counted in `arity`.
     int32 upvalue_count;
+    int32 copied_count;
     Chunk chunk;
     ObjString* name;
+    ObjString* getter;  // The field a `return this.field;` method reads.
 } ObjFunction;
 
 typedef Value (*NativeFn)(int32 arg_count, Value* args, bool* success);
@@ -37,13 +47,40 @@ typedef struct {
     NativeFn function;
 } ObjNative;
 
+// Strings made at runtime by take_string() are not interned and have a
+// hash of 0. Only interned strings can be used as table keys.
+//
+// A view has a `parent` and borrows `length` bytes of the parent's buffer,
+// so its chars are not NUL-terminated. The parent is never a view itself.
 struct ObjString {
     Obj obj;
     int32 length;
     char* chars;
     uint32 hash;
+    struct ObjString* parent;
 };
 
+// The lazy result of concatenating two long strings. Each half is a
+// string value or another rope. Flattening copies the halves into a
+// string once, caches it in `flat` and drops the halves.
+typedef struct {
+    Obj obj;
+    int32 length;
+    int32 depth;
+    Value left;
+    Value right;
+    ObjString* flat;
+} ObjRope;
+
+// The bytes of a string value that is not a rope. Short strings are
+// unpacked into `buffer`, and `string` is NULL for them.
+typedef struct {
+    ObjString* string;
+    const char* chars;
+    int32 length;
+    char buffer[8];
+} StringChars;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -56,6 +93,8 @@ typedef struct {
     ObjFunction* function;
     ObjUpvalue** upvalues;
     int32 upvalue_count;
+    int32 copied_count;
+    Value copied[];  // Captured variables that are never assigned.
 } ObjClosure;
 
 typedef struct {
@@ -82,9 +121,20 @@ ObjClosure* new_closure(ObjFunction* function);
 ObjFunction* new_function();
 ObjInstance* new_instance(ObjClass* class);
 ObjNative* new_native(NativeFn function);
+ObjRope* new_rope(Value left, Value right);
+ObjString* flatten_rope(ObjRope* rope);
 ObjString* take_string(char* chars, int32 length);
 ObjString* copy_string(const char* chars, int32 length);
+ObjString* new_view(ObjString* string, int32 start, int32 length);
+Value copy_string_value(const char* chars, int32 length);
+Value take_string_value(char* chars, int32 length);
+Value slice_string_value(StringChars* chars, int32 start, int32 length);
+int32 string_value_length(Value value);
+void string_value_chars(Value value, StringChars* chars);
 ObjUpvalue* new_upvalue(Value* slot);
+void seed_string_hash();
+uint32 hash_string(const char* key, int32 length);
+const char* obj_type_name(ObjType type);
 void print_object(Value value);
 
 static inline bool is_obj_type(Value value, ObjType type) {
@@ -119,10 +169,35 @@ static inline bool is_native(Value value) {
     return is_obj_type(value, ObjectNative);
 }
 
+static inline bool is_rope(Value value) {
+    return is_obj_type(value, ObjectRope);
+}
+
 static inline bool is_string(Value value) {
     return is_obj_type(value, ObjectString);
 }
 
+// Lox never sees a heap string that would fit in a short string, so two
+// short strings are equal exactly when their Values are.
+static inline bool fits_short_string(int32 length) {
+    #ifdef NAN_BOXING
+    return length <= SHORT_STRING_MAX;
+    #else
+    (void) length;
+    return false;
+    #endif
+}
+
+// Whether Lox treats the value as a string, whatever its representation.
+static inline bool is_string_value(Value value) {
+    #ifdef NAN_BOXING
+    if (is_short_string(value)) {
+        return true;
+    }
+    #endif
+    return is_string(value) || is_rope(value);
+}
+
 static inline ObjBoundMethod* as_bound_method(Value value) {
     return (ObjBoundMethod*) as_obj(value);
 }
@@ -147,6 +222,10 @@ static inline NativeFn as_native(Value value) {
     return ((ObjNative*) as_obj(value))->function;
 }
 
+static inline ObjRope* as_rope(Value value) {
+    return (ObjRope*) as_obj(value);
+}
+
 static inline ObjString* as_string(Value value) {
     return (ObjString*) as_obj(value);
 }
@@ -154,3 +233,18 @@ static inline ObjString* as_string(Value value) {
 static inline char* as_cstring(Value value) {
     return as_string(value)->chars;
 }
+
+static inline bool is_interned(ObjString* string) {
+    return string->hash != 0;
+}
+
+// Two interned strings are equal only if they are the same object.
+static inline bool strings_equal(ObjString* a, ObjString* b) {
+    if (a == b) {
+        return true;
+    }
+    if (is_interned(a) && is_interned(b)) {
+        return false;
+    }
+    return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
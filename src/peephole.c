@@ -0,0 +1,381 @@
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "peephole.h"
+
+#define THREAD_MAX 16
+
+// A decoded instruction. Offsets and targets refer to the code as the
+// compiler emitted it; the chunk is only rewritten once every pass is done.
+typedef struct {
+    int32 offset;
+    int32 length;
+    uint8 op;
+    int32 target;
+    bool is_target;
+    bool removed;
+} Instruction;
+
+typedef struct {
+    Chunk* chunk;
+    Instruction* code;
+    int32 count;
+    int32* index;
+} Peephole;
+
+static int32 instruction_length(Chunk* chunk, int32 offset) {
+    switch (chunk->code[offset]) {
+        case OpConstant:
+        case OpGetLocal:
+        case OpSetLocal:
+        case OpGetGlobal:
+        case OpDefineGlobal:
+        case OpSetGlobal:
+        case OpHoistGlobal:
+        case OpGetUpvalue:
+        case OpSetUpvalue:
+        case OpGetCopied:
+        case OpGetProperty:
+        case OpSetProperty:
+        case OpGetSuper:
+        case OpCall:
+        case OpTailCall:
+        case OpClass:
+        case OpMethod: {
+            return 2;
+        }
+        case OpGetHoisted:
+        case OpJump:
+        case OpJumpIfFalse:
+        case OpJumpIfNotLess:
+        case OpJumpIfNotGreater:
+        case OpJumpIfNotEqual:
+        case OpLoop:
+        case OpInvoke:
+        case OpTailInvoke:
+        case OpSuperInvoke: {
+            return 3;
+        }
+        case OpInlineGuard: {
+            return 4;
+        }
+        case OpForLoop: {
+            return 7;
+        }
+        case OpClosure: {
+            ObjFunction* function = as_function(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * (function->upvalue_count + function->copied_count);
+        }
+        default: {
+            return 1;
+        }
+    }
+}
+
+static bool is_jump(uint8 op) {
+    switch (op) {
+        case OpJump:
+        case OpJumpIfFalse:
+        case OpJumpIfNotLess:
+        case OpJumpIfNotGreater:
+        case OpJumpIfNotEqual:
+        case OpInlineGuard:
+        case OpLoop:
+        case OpForLoop: {
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+static bool is_backward(uint8 op) {
+    return op == OpLoop || op == OpForLoop;
+}
+
+static bool ends_flow(uint8 op) {
+    return op == OpJump || op == OpLoop || op == OpReturn;
+}
+
+// Pushes that can't fail and have no side effects.
+static bool is_pure_push(uint8 op) {
+    switch (op) {
+        case OpConstant:
+        case OpNil:
+        case OpTrue:
+        case OpFalse:
+        case OpGetLocal:
+        case OpGetUpvalue:
+        case OpGetCopied: {
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+static uint8 negated_compare(uint8 op) {
+    switch (op) {
+        case OpEqual: {
+            return OpNotEqual;
+        }
+        case OpLess: {
+            return OpGreaterEqual;
+        }
+        case OpGreater: {
+            return OpLessEqual;
+        }
+        default: {
+            return op;
+        }
+    }
+}
+
+// The distance of a jump is in its last two bytes, and counts from the end
+// of the instruction.
+static int32 read_target(Chunk* chunk, int32 offset, int32 length) {
+    int32 end = offset + length;
+    int32 distance = (chunk->code[end - 2] << 8) | chunk->code[end - 1];
+    return is_backward(chunk->code[offset]) ? end - distance : end + distance;
+}
+
+static Instruction* at_offset(Peephole* peephole, int32 offset) {
+    return offset < peephole->chunk->count ? &peephole->code[peephole->index[offset]] : NULL;
+}
+
+static void mark_targets(Peephole* peephole) {
+    for (int32 i = 0; i < peephole->count; i++) {
+        peephole->code[i].is_target = false;
+    }
+    for (int32 i = 0; i < peephole->count; i++) {
+        Instruction* instruction = &peephole->code[i];
+        if (!instruction->removed && is_jump(instruction->op)) {
+            Instruction* target = at_offset(peephole, instruction->target);
+            if (target != NULL) {
+                target->is_target = true;
+            }
+        }
+    }
+}
+
+// Follows jumps that land on unconditional jumps. A conditional jump can
+// also skip a conditional jump at its target, since the condition is
+// still on the stack and takes the same branch again.
+static void thread_jump(Peephole* peephole, Instruction* jump) {
+    int32 target = jump->target;
+    for (int32 i = 0; i < THREAD_MAX; i++) {
+        Instruction* next = at_offset(peephole, target);
+        if (next == NULL || next == jump) {
+            break;
+        }
+        if (next->op != OpJump && (next->op != OpJumpIfFalse || jump->op != OpJumpIfFalse)) {
+            break;
+        }
+        target = next->target;
+    }
+
+    int32 end = jump->offset + jump->length;
+    int32 distance = is_backward(jump->op) ? end - target : target - end;
+    if (distance >= 0 && distance <= UINT16_MAX) {
+        jump->target = target;
+    }
+}
+
+// An unconditional jump to a return is replaced by the return itself.
+static void inline_return(Peephole* peephole, Instruction* jump) {
+    Chunk* chunk = peephole->chunk;
+    Instruction* target = at_offset(peephole, jump->target);
+    if (target == NULL) {
+        return;
+    }
+
+    // The target may itself be a jump that was already replaced.
+    uint8* code = &chunk->code[target->offset];
+    if (code[0] == OpReturn) {
+        chunk->code[jump->offset] = OpReturn;
+        jump->length = 1;
+    } else if (code[0] == OpNil && target->offset + 1 < chunk->count && code[1] == OpReturn) {
+        chunk->code[jump->offset] = OpNil;
+        chunk->code[jump->offset + 1] = OpReturn;
+        jump->length = 2;
+    } else {
+        return;
+    }
+    jump->op = OpReturn;
+    jump->target = -1;
+}
+
+static void remove_unreachable(Peephole* peephole) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        mark_targets(peephole);
+
+        bool reachable = true;
+        for (int32 i = 0; i < peephole->count; i++) {
+            Instruction* instruction = &peephole->code[i];
+            if (instruction->removed) {
+                continue;
+            }
+            if (instruction->is_target) {
+                reachable = true;
+            }
+            if (!reachable) {
+                instruction->removed = true;
+                changed = true;
+            } else if (ends_flow(instruction->op)) {
+                reachable = false;
+            }
+        }
+    }
+}
+
+// Rewrites adjacent pairs: a comparison followed by OpNot becomes the
+// negated comparison, and a pure push followed by OpPop disappears. The
+// second instruction of a pair must not be a jump target.
+static void fuse_pairs(Peephole* peephole, int32* kept) {
+    int32 kept_count = 0;
+    bool carry_target = false;
+
+    for (int32 i = 0; i < peephole->count; i++) {
+        Instruction* instruction = &peephole->code[i];
+        if (instruction->removed) {
+            continue;
+        }
+        if (carry_target) {
+            instruction->is_target = true;
+            carry_target = false;
+        }
+
+        if (kept_count > 0 && !instruction->is_target) {
+            Instruction* previous = &peephole->code[kept[kept_count - 1]];
+            uint8 negated = negated_compare(previous->op);
+            if (instruction->op == OpNot && negated != previous->op) {
+                previous->op = negated;
+                peephole->chunk->code[previous->offset] = negated;
+                instruction->removed = true;
+                continue;
+            }
+            if (instruction->op == OpPop && is_pure_push(previous->op)) {
+                previous->removed = true;
+                instruction->removed = true;
+                carry_target = previous->is_target;
+                kept_count--;
+                continue;
+            }
+        }
+        kept[kept_count++] = i;
+    }
+}
+
+static int32 next_kept(Peephole* peephole, int32 i) {
+    while (i < peephole->count && peephole->code[i].removed) {
+        i++;
+    }
+    return i;
+}
+
+// Jumps to the instruction right after them do nothing. Walking backwards
+// lets a run of such jumps collapse.
+static void remove_empty_jumps(Peephole* peephole) {
+    for (int32 i = peephole->count - 1; i >= 0; i--) {
+        Instruction* instruction = &peephole->code[i];
+        if (instruction->removed || (instruction->op != OpJump && instruction->op != OpJumpIfFalse)) {
+            continue;
+        }
+        int32 target = instruction->target < peephole->chunk->count ? peephole->index[instruction->target] : peephole->count;
+        if (next_kept(peephole, target) == next_kept(peephole, i + 1)) {
+            instruction->removed = true;
+        }
+    }
+}
+
+// Lays out the remaining instructions and repoints every jump. Removed
+// instructions map to the next one kept, which is where a jump to them
+// now lands.
+static void rewrite_chunk(Peephole* peephole, Arena* arena) {
+    Chunk* chunk = peephole->chunk;
+    int32* new_offset = ARENA_ALLOCATE(arena, int32, peephole->count + 1);
+    int32 count = 0;
+    for (int32 i = 0; i < peephole->count; i++) {
+        new_offset[i] = count;
+        if (!peephole->code[i].removed) {
+            count += peephole->code[i].length;
+        }
+    }
+    new_offset[peephole->count] = count;
+
+    uint8* code = ARENA_ALLOCATE(arena, uint8, count);
+    int32* lines = ARENA_ALLOCATE(arena, int32, count);
+    for (int32 i = 0; i < peephole->count; i++) {
+        Instruction* instruction = &peephole->code[i];
+        if (instruction->removed) {
+            continue;
+        }
+        int32 offset = new_offset[i];
+        memcpy(code + offset, chunk->code + instruction->offset, instruction->length);
+        memcpy(lines + offset, chunk->lines + instruction->offset, sizeof(int32) * instruction->length);
+
+        if (is_jump(instruction->op)) {
+            int32 target_index = instruction->target < chunk->count ? peephole->index[instruction->target] : peephole->count;
+            int32 target = new_offset[target_index];
+            int32 end = offset + instruction->length;
+            int32 distance = is_backward(instruction->op) ? end - target : target - end;
+            code[end - 2] = (distance >> 8) & 0xff;
+            code[end - 1] = distance & 0xff;
+        }
+    }
+
+    for (int32 i = 0; i < chunk->inline_count; i++) {
+        InlineSite* site = &chunk->inline_sites[i];
+        site->start = new_offset[site->start < chunk->count ? peephole->index[site->start] : peephole->count];
+        site->end = new_offset[site->end < chunk->count ? peephole->index[site->end] : peephole->count];
+    }
+
+    memcpy(chunk->code, code, count);
+    memcpy(chunk->lines, lines, sizeof(int32) * count);
+    chunk->count = count;
+}
+
+// Cleans up the code of a finished function. Scratch memory comes from
+// `arena`.
+void optimize_chunk(Chunk* chunk, Arena* arena) {
+    if (chunk->count == 0) {
+        return;
+    }
+
+    Peephole peephole;
+    peephole.chunk = chunk;
+    peephole.code = ARENA_ALLOCATE(arena, Instruction, chunk->count);
+    peephole.index = ARENA_ALLOCATE(arena, int32, chunk->count);
+    peephole.count = 0;
+
+    for (int32 offset = 0; offset < chunk->count; ) {
+        Instruction* instruction = &peephole.code[peephole.count];
+        instruction->offset = offset;
+        instruction->length = instruction_length(chunk, offset);
+        instruction->op = chunk->code[offset];
+        instruction->target = is_jump(instruction->op) ? read_target(chunk, offset, instruction->length) : -1;
+        instruction->removed = false;
+        peephole.index[offset] = peephole.count++;
+        offset += instruction->length;
+    }
+
+    for (int32 i = 0; i < peephole.count; i++) {
+        Instruction* instruction = &peephole.code[i];
+        if (is_jump(instruction->op)) {
+            thread_jump(&peephole, instruction);
+        }
+        if (instruction->op == OpJump) {
+            inline_return(&peephole, instruction);
+        }
+    }
+
+    remove_unreachable(&peephole);
+    fuse_pairs(&peephole, ARENA_ALLOCATE(arena, int32, peephole.count));
+    remove_empty_jumps(&peephole);
+    rewrite_chunk(&peephole, arena);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "chunk.h"
+
+void optimize_chunk(Chunk* chunk, Arena* arena);
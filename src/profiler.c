@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "profiler.h"
+#include "vm.h"
+
+// Profiler bookkeeping uses malloc directly so it neither counts towards
+// vm.bytes_allocated nor triggers collections.
+
+#define MAX_SITES UINT16_MAX
+
+typedef struct {
+    ObjFunction* function;
+    bool detached;
+    char* name;
+    int32 line;
+    ObjType type;
+    uint64 count;
+    uint64 bytes;
+    uint64 survived;
+    uint64 died_young;
+} AllocSite;
+
+typedef struct {
+    AllocSite* sites;
+    int32 site_count;
+    int32 site_capacity;
+    uint16* index;
+    int32 index_capacity;
+    uint64 dropped;
+} Profiler;
+
+static Profiler profiler;
+
+static void* checked_realloc(void* pointer, usize size) {
+    void* result = realloc(pointer, size);
+    if (result == NULL) {
+        exit(1);
+    }
+    return result;
+}
+
+void init_profiler() {
+    profiler.sites = NULL;
+    profiler.site_count = 0;
+    profiler.site_capacity = 0;
+    profiler.index = NULL;
+    profiler.index_capacity = 0;
+    profiler.dropped = 0;
+}
+
+void free_profiler() {
+    for (int32 i = 0; i < profiler.site_count; i++) {
+        free(profiler.sites[i].name);
+    }
+    free(profiler.sites);
+    free(profiler.index);
+    init_profiler();
+}
+
+static uint32 hash_site(ObjFunction* function, int32 line, ObjType type) {
+    uint64 hash = (uint64) (uintptr) function >> 3;
+    hash = hash * 31 + (uint64) line;
+    hash = hash * 31 + (uint64) type;
+    return (uint32) (hash ^ (hash >> 32)) * 2654435761u;
+}
+
+static void index_site(uint16 site) {
+    AllocSite* entry = &profiler.sites[site - 1];
+    uint32 slot = hash_site(entry->function, entry->line, entry->type) & (profiler.index_capacity - 1);
+    while (profiler.index[slot] != 0) {
+        slot = (slot + 1) & (profiler.index_capacity - 1);
+    }
+    profiler.index[slot] = site;
+}
+
+static void grow_index() {
+    int32 capacity = profiler.index_capacity < 64 ? 64 : profiler.index_capacity * 2;
+    free(profiler.index);
+    profiler.index = (uint16*) checked_realloc(NULL, sizeof(uint16) * capacity);
+    memset(profiler.index, 0, sizeof(uint16) * capacity);
+    profiler.index_capacity = capacity;
+    for (int32 i = 1; i <= profiler.site_count; i++) {
+        index_site((uint16) i);
+    }
+}
+
+static char* site_name(ObjFunction* function) {
+    const char* name = "<compiler>";
+    if (function != NULL) {
+        name = function->name != NULL ? function->name->chars : "<script>";
+    }
+    usize length = strlen(name);
+    char* copy = (char*) checked_realloc(NULL, length + 1);
+    memcpy(copy, name, length + 1);
+    return copy;
+}
+
+static uint16 find_site(ObjFunction* function, int32 line, ObjType type) {
+    if (profiler.index_capacity != 0) {
+        uint32 slot = hash_site(function, line, type) & (profiler.index_capacity - 1);
+        while (profiler.index[slot] != 0) {
+            AllocSite* site = &profiler.sites[profiler.index[slot] - 1];
+            if (!site->detached && site->function == function && site->line == line && site->type == type) {
+                return profiler.index[slot];
+            }
+            slot = (slot + 1) & (profiler.index_capacity - 1);
+        }
+    }
+
+    if (profiler.site_count == MAX_SITES) {
+        return 0;
+    }
+
+    if (profiler.site_capacity < profiler.site_count + 1) {
+        profiler.site_capacity = profiler.site_capacity < 64 ? 64 : profiler.site_capacity * 2;
+        profiler.sites = (AllocSite*) checked_realloc(profiler.sites, sizeof(AllocSite) * profiler.site_capacity);
+    }
+
+    AllocSite* site = &profiler.sites[profiler.site_count++];
+    site->function = function;
+    site->detached = false;
+    site->name = site_name(function);
+    site->line = line;
+    site->type = type;
+    site->count = 0;
+    site->bytes = 0;
+    site->survived = 0;
+    site->died_young = 0;
+
+    if ((profiler.site_count + 1) * 2 > profiler.index_capacity) {
+        grow_index();
+    } else {
+        index_site((uint16) profiler.site_count);
+    }
+    return (uint16) profiler.site_count;
+}
+
+uint16 profile_allocation(ObjType type, usize size) {
+    ObjFunction* function = NULL;
+    int32 line = 0;
+    if (vm.frame_count > 0) {
+        CallFrame* frame = &vm.frames[vm.frame_count - 1];
+        function = frame->closure->function;
+        int32 instruction = (int32) (frame->ip - function->chunk.code) - 1;
+        line = function->chunk.lines[instruction < 0 ? 0 : instruction];
+    }
+
+    uint16 site = find_site(function, line, type);
+    if (site == 0) {
+        profiler.dropped++;
+        return 0;
+    }
+    profiler.sites[site - 1].count++;
+    profiler.sites[site - 1].bytes += size;
+    return site;
+}
+
+void profile_add_bytes(uint16 site, usize size) {
+    if (site != 0) {
+        profiler.sites[site - 1].bytes += size;
+    }
+}
+
+void profile_survivor(Obj* object) {
+    if (object->alloc_site != 0 && !object->has_survived) {
+        object->has_survived = true;
+        profiler.sites[object->alloc_site - 1].survived++;
+    }
+}
+
+void profile_free(Obj* object) {
+    if (object->alloc_site != 0 && !object->has_survived) {
+        profiler.sites[object->alloc_site - 1].died_young++;
+    }
+}
+
+void profile_forget_function(ObjFunction* function) {
+    // The address may be reused by a later function, so detach its sites.
+    for (int32 i = 0; i < profiler.site_count; i++) {
+        if (profiler.sites[i].function == function) {
+            profiler.sites[i].detached = true;
+        }
+    }
+}
+
+static int compare_sites(const void* a, const void* b) {
+    const AllocSite* left = *(const AllocSite**) a;
+    const AllocSite* right = *(const AllocSite**) b;
+    if (left->bytes != right->bytes) {
+        return left->bytes < right->bytes ? 1 : -1;
+    }
+    if (left->count != right->count) {
+        return left->count < right->count ? 1 : -1;
+    }
+    return 0;
+}
+
+static float64 survivor_rate(AllocSite* site) {
+    uint64 collected = site->survived + site->died_young;
+    return collected == 0 ? 0 : (float64) site->survived / (float64) collected;
+}
+
+void dump_alloc_profile(FILE* file, bool json) {
+    AllocSite** sorted = (AllocSite**) checked_realloc(NULL, sizeof(AllocSite*) * (profiler.site_count + 1));
+    for (int32 i = 0; i < profiler.site_count; i++) {
+        sorted[i] = &profiler.sites[i];
+    }
+    qsort(sorted, profiler.site_count, sizeof(AllocSite*), compare_sites);
+
+    if (json) {
+        fprintf(file, "{\n  \"dropped\": %llu,\n  \"sites\": [", (unsigned long long) profiler.dropped);
+        for (int32 i = 0; i < profiler.site_count; i++) {
+            AllocSite* site = sorted[i];
+            fprintf(file, "%s\n    { \"function\": \"%s\", \"line\": %d, \"type\": \"%s\", \"count\": %llu, \"bytes\": %llu, \"survived\": %llu, \"died_young\": %llu, \"survivor_rate\": %.4f }",
+                    i == 0 ? "" : ",", site->name, site->line, obj_type_name(site->type),
+                    (unsigned long long) site->count, (unsigned long long) site->bytes,
+                    (unsigned long long) site->survived, (unsigned long long) site->died_young, survivor_rate(site));
+        }
+        fprintf(file, "%s]\n}\n", profiler.site_count == 0 ? "" : "\n  ");
+    } else {
+        fprintf(file, "== allocation profile ==\n");
+        fprintf(file, "%12s %10s %9s  %-12s %s\n", "bytes", "count", "survived", "type", "site");
+        for (int32 i = 0; i < profiler.site_count; i++) {
+            AllocSite* site = sorted[i];
+            fprintf(file, "%12llu %10llu %8.1f%%  %-12s %s:%d\n",
+                    (unsigned long long) site->bytes, (unsigned long long) site->count, survivor_rate(site) * 100,
+                    obj_type_name(site->type), site->name, site->line);
+        }
+        if (profiler.dropped != 0) {
+            fprintf(file, "%llu allocations were not attributed (too many sites).\n", (unsigned long long) profiler.dropped);
+        }
+    }
+
+    free(sorted);
+}
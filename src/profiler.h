@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+#include "object.h"
+
+void init_profiler();
+void free_profiler();
+uint16 profile_allocation(ObjType type, usize size);
+void profile_add_bytes(uint16 site, usize size);
+void profile_survivor(Obj* object);
+void profile_free(Obj* object);
+void profile_forget_function(ObjFunction* function);
+void dump_alloc_profile(FILE* file, bool json);
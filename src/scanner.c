@@ -4,12 +4,6 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char* start;
-    const char* current;
-    int32 line;
-} Scanner;
-
 Scanner scanner;
 
 void init_scanner(const char* source) {
@@ -18,6 +12,14 @@ void init_scanner(const char* source) {
     scanner.line = 1;
 }
 
+Scanner save_scanner() {
+    return scanner;
+}
+
+void restore_scanner(Scanner saved) {
+    scanner = saved;
+}
+
 static bool is_alpha(char ch) {
     return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
 }
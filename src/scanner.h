@@ -30,5 +30,13 @@ typedef struct {
     int32 line;
 } Token;
 
+typedef struct {
+    const char* start;
+    const char* current;
+    int32 line;
+} Scanner;
+
 void init_scanner(const char* source);
+Scanner save_scanner();
+void restore_scanner(Scanner saved);
 Token scan_token();
@@ -5,39 +5,192 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
-#define TABLE_MAX_LOAD 0.75
+#if defined(__SSE2__) && !defined(TABLE_NO_SIMD)
+#include <emmintrin.h>
+#define TABLE_SIMD
+#endif
+
+// Open addressing with a separate control byte per slot. A full slot
+// stores the low 7 bits of the key's hash, so most mismatches are
+// rejected without touching the entry. Slots are probed a group at a
+// time, starting at the key's home slot.
+//
+// Entries are kept in Robin Hood order and deletion shifts the following
+// entries back, so there are no tombstones and every key sits in the run
+// of full slots that starts at its home slot.
+//
+// Most instances and classes only hold a handful of keys. Up to
+// TABLE_SMALL_MAX of them are kept unhashed in a packed array with no
+// control bytes, and found by comparing key pointers.
+#define GROUP_WIDTH 16
+#define TABLE_SMALL_MIN 4
+#define TABLE_SMALL_MAX 8
+#define TABLE_MIN_CAPACITY 16
+#define TABLE_MAX_LOAD 0.875
+
+#define CTRL_EMPTY ((uint8) 0x80)
+
+static inline uint8 hash_fragment(uint32 hash) {
+    return (uint8) (hash & 0x7f);
+}
+
+static inline uint32 home_slot(uint32 hash, int32 capacity) {
+    return (hash >> 7) & (capacity - 1);
+}
+
+static inline bool is_full(uint8 control) {
+    return (control & 0x80) == 0;
+}
+
+#ifdef TABLE_SIMD
+
+static inline uint32 group_match(const uint8* control, uint8 byte) {
+    __m128i group = _mm_loadu_si128((const __m128i*) control);
+    return (uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) byte)));
+}
+
+#else
+
+static inline uint32 group_match(const uint8* control, uint8 byte) {
+    uint32 mask = 0;
+    for (int32 i = 0; i < GROUP_WIDTH; i++) {
+        mask |= (uint32) (control[i] == byte) << i;
+    }
+    return mask;
+}
+
+#endif
+
+static inline uint32 group_match_empty(const uint8* control) {
+    return group_match(control, CTRL_EMPTY);
+}
+
+static inline bool is_small(Table* table) {
+    return table->control == NULL;
+}
+
+// Number of slots to visit when walking every entry, and whether slot
+// `index` holds one.
+static inline int32 slot_limit(Table* table) {
+    return is_small(table) ? table->count : table->capacity;
+}
+
+static inline bool has_entry(Table* table, int32 index) {
+    return is_small(table) || is_full(table->control[index]);
+}
+
+static inline int32 lowest_bit(uint32 mask) {
+    return __builtin_ctz(mask);
+}
+
+// The first GROUP_WIDTH - 1 control bytes are mirrored past the end so a
+// group can be loaded from any slot without wrapping.
+static void set_control(Table* table, int32 index, uint8 control) {
+    table->control[index] = control;
+    if (index < GROUP_WIDTH - 1) {
+        table->control[table->capacity + index] = control;
+    }
+}
 
 void init_table(Table* table) {
     table->count = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void free_table(Table* table) {
+    if (!is_small(table)) {
+        FREE_ARRAY(uint8, table->control, table->capacity + GROUP_WIDTH);
+    }
     FREE_ARRAY(Entry, table->entries, table->capacity);
     init_table(table);
 }
 
-static Entry* find_entry(Entry* entries, int32 capacity, ObjString* key) {
-    uint32 index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+static int32 find_slot(Table* table, ObjString* key) {
+    if (is_small(table)) {
+        for (int32 i = 0; i < table->count; i++) {
+            if (table->entries[i].key == key) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    uint8 fragment = hash_fragment(key->hash);
+    uint32 mask = table->capacity - 1;
+    uint32 position = home_slot(key->hash, table->capacity);
 
     while (true) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (is_nil(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) {
-                    tombstone = entry;
-                }
+        const uint8* group = &table->control[position];
+        for (uint32 matches = group_match(group, fragment); matches != 0; matches &= matches - 1) {
+            uint32 index = (position + lowest_bit(matches)) & mask;
+            if (table->entries[index].key == key) {
+                return (int32) index;
             }
-        } else if (entry->key == key) {
-            return entry;
         }
-        index = (index + 1) & (capacity - 1);
+        if (group_match_empty(group) != 0) {
+            return -1;
+        }
+        position = (position + GROUP_WIDTH) & mask;
+    }
+}
+
+static uint32 probe_distance(Table* table, uint32 index) {
+    return (index - home_slot(table->entries[index].key->hash, table->capacity)) & (table->capacity - 1);
+}
+
+// Inserts a key that is known to be absent. Whenever the entry being
+// placed is further from home than the slot's occupant, they swap.
+static void insert_entry(Table* table, ObjString* key, Value value) {
+    uint32 mask = table->capacity - 1;
+    uint32 index = home_slot(key->hash, table->capacity);
+    uint32 distance = 0;
+    Entry entry = { key, value };
+
+    while (true) {
+        if (table->control[index] == CTRL_EMPTY) {
+            set_control(table, index, hash_fragment(entry.key->hash));
+            table->entries[index] = entry;
+            table->count++;
+            return;
+        }
+
+        uint32 existing = probe_distance(table, index);
+        if (existing < distance) {
+            Entry displaced = table->entries[index];
+            set_control(table, index, hash_fragment(entry.key->hash));
+            table->entries[index] = entry;
+            entry = displaced;
+            distance = existing;
+        }
+
+        index = (index + 1) & mask;
+        distance++;
+    }
+}
+
+static void remove_entry(Table* table, uint32 index) {
+    if (is_small(table)) {
+        table->count--;
+        table->entries[index] = table->entries[table->count];
+        return;
     }
+
+    uint32 mask = table->capacity - 1;
+    uint32 next = (index + 1) & mask;
+
+    while (is_full(table->control[next]) && probe_distance(table, next) != 0) {
+        set_control(table, index, table->control[next]);
+        table->entries[index] = table->entries[next];
+        index = next;
+        next = (next + 1) & mask;
+    }
+
+    set_control(table, index, CTRL_EMPTY);
+    table->count--;
 }
 
 bool table_get(Table* table, ObjString* key, Value* value) {
@@ -45,55 +198,66 @@ bool table_get(Table* table, ObjString* key, Value* value) {
         return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int32 index = find_slot(table, key);
+    if (index == -1) {
         return false;
     }
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
 static void adjust_capacity(Table* table, int32 capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int32 i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = nil_val();
+    // Both arrays are checked for up front, so a failure cannot strand the
+    // first one.
+    usize size = sizeof(uint8) * (capacity + GROUP_WIDTH) + sizeof(Entry) * capacity;
+    if (!heap_has_room(size)) {
+        out_of_memory_error(size);
     }
 
-    table->count = 0;
-    for (int32 i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) {
-            continue;
-        }
+    Table resized;
+    resized.count = 0;
+    resized.capacity = capacity;
+    resized.control = ALLOCATE(uint8, capacity + GROUP_WIDTH);
+    resized.entries = ALLOCATE(Entry, capacity);
+    memset(resized.control, CTRL_EMPTY, capacity + GROUP_WIDTH);
 
-        Entry* dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+    for (int32 i = 0; i < slot_limit(table); i++) {
+        if (has_entry(table, i)) {
+            insert_entry(&resized, table->entries[i].key, table->entries[i].value);
+        }
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    free_table(table);
+    *table = resized;
 }
 
 bool table_set(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int32 capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+    if (table->count != 0) {
+        int32 index = find_slot(table, key);
+        if (index != -1) {
+            table->entries[index].value = value;
+            return false;
+        }
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && is_nil(entry->value)) {
-        table->count++;
+    if (is_small(table)) {
+        if (table->count < TABLE_SMALL_MAX) {
+            if (table->count == table->capacity) {
+                int32 capacity = table->capacity < TABLE_SMALL_MIN ? TABLE_SMALL_MIN : table->capacity * 2;
+                table->entries = GROW_ARRAY(Entry, table->entries, table->capacity, capacity);
+                table->capacity = capacity;
+            }
+            table->entries[table->count++] = (Entry) { key, value };
+            return true;
+        }
+        adjust_capacity(table, TABLE_MIN_CAPACITY);
+    } else if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        adjust_capacity(table, table->capacity * 2);
     }
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    insert_entry(table, key, value);
+    return true;
 }
 
 bool table_delete(Table* table, ObjString* key) {
@@ -101,57 +265,45 @@ bool table_delete(Table* table, ObjString* key) {
         return false;
     }
 
-    Entry* entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int32 index = find_slot(table, key);
+    if (index == -1) {
         return false;
     }
 
-    entry->key = NULL;
-    entry->value = bool_val(true);
+    remove_entry(table, (uint32) index);
     return true;
 }
 
-void table_add_all(Table* from, Table* to) {
-    for (int32 i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            table_set(to, entry->key, entry->value);
-        }
-    }
-}
-
-ObjString* table_find_string(Table* table, const char* chars, int32 length, uint32 hash) {
-    if (table->count == 0) {
-        return NULL;
+// The furthest any key sits from its home slot, which bounds how many
+// slots a lookup visits.
+int32 table_max_probe(Table* table) {
+    int32 max = 0;
+    if (is_small(table)) {
+        return max;
     }
-
-    uint32 index = hash & (table->capacity - 1);
-    while (true) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (is_nil(entry->value)) {
-                return NULL;
-            }
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+    for (int32 i = 0; i < table->capacity; i++) {
+        if (is_full(table->control[i]) && (int32) probe_distance(table, i) > max) {
+            max = (int32) probe_distance(table, i);
         }
-        index = (index + 1) & (table->capacity - 1);
     }
+    return max;
 }
 
-void table_remove_white(Table* table) {
-    for (int32 i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked) {
-            table_delete(table, entry->key);
+void table_add_all(Table* from, Table* to) {
+    for (int32 i = 0; i < slot_limit(from); i++) {
+        if (has_entry(from, i)) {
+            Entry* entry = &from->entries[i];
+            table_set(to, entry->key, entry->value);
         }
     }
 }
 
 void mark_table(Table* table) {
-    for (int32 i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        mark_object((Obj*) entry->key);
-        mark_value(entry->value);
+    for (int32 i = 0; i < slot_limit(table); i++) {
+        if (has_entry(table, i)) {
+            Entry* entry = &table->entries[i];
+            mark_object((Obj*) entry->key);
+            mark_value(entry->value);
+        }
     }
 }
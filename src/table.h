@@ -8,9 +8,12 @@ typedef struct {
     Value value;
 } Entry;
 
+// Tables with only a few keys have no control bytes. Their entries are
+// packed at the front of the array and looked up by scanning.
 typedef struct {
     int32 count;
     int32 capacity;
+    uint8* control;
     Entry* entries;
 } Table;
 
@@ -19,7 +22,6 @@ void free_table(Table* table);
 bool table_get(Table* table, ObjString* key, Value* value);
 bool table_set(Table* table, ObjString* key, Value value);
 bool table_delete(Table* table, ObjString* key);
+int32 table_max_probe(Table* table);
 void table_add_all(Table* from, Table* to);
-ObjString* table_find_string(Table* table, const char* chars, int32 length, uint32 hash);
-void table_remove_white(Table* table);
 void mark_table(Table* table);
@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "text.h"
+
+#if defined(__SSE2__) && !defined(TEXT_NO_SIMD)
+#include <emmintrin.h>
+#define TEXT_SIMD
+#endif
+
+#define BLOCK_WIDTH 16
+
+static int32 find_scalar(const char* haystack, int32 length, const char* needle, int32 needle_length, int32 start) {
+    const char* end = haystack + length - needle_length + 1;
+    const char* cursor = haystack + start;
+    while (cursor < end) {
+        cursor = memchr(cursor, needle[0], end - cursor);
+        if (cursor == NULL) {
+            return -1;
+        }
+        if (memcmp(cursor + 1, needle + 1, needle_length - 1) == 0) {
+            return (int32) (cursor - haystack);
+        }
+        cursor++;
+    }
+    return -1;
+}
+
+#ifdef TEXT_SIMD
+
+// Compares 16 candidate positions at once against the needle's first and
+// last byte. Only positions matching both are checked with memcmp.
+static int32 find_blocks(const char* haystack, int32 length, const char* needle, int32 needle_length, int32 start) {
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    int32 limit = length - needle_length + 1;
+    int32 i = start;
+
+    for (; i + BLOCK_WIDTH <= limit; i += BLOCK_WIDTH) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*) (haystack + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*) (haystack + i + needle_length - 1));
+        __m128i matches = _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last));
+        for (uint32 mask = (uint32) _mm_movemask_epi8(matches); mask != 0; mask &= mask - 1) {
+            int32 index = i + __builtin_ctz(mask);
+            if (memcmp(haystack + index + 1, needle + 1, needle_length - 2) == 0) {
+                return index;
+            }
+        }
+    }
+
+    return i < limit ? find_scalar(haystack, length, needle, needle_length, i) : -1;
+}
+
+static int32 count_byte(const char* chars, int32 length, char byte) {
+    __m128i target = _mm_set1_epi8(byte);
+    int32 count = 0;
+    int32 i = 0;
+    for (; i + BLOCK_WIDTH <= length; i += BLOCK_WIDTH) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (chars + i));
+        count += __builtin_popcount((uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(block, target)));
+    }
+    for (; i < length; i++) {
+        count += chars[i] == byte;
+    }
+    return count;
+}
+
+#endif
+
+// Returns the index of the first occurrence at or after `start`, or -1.
+int32 text_find(const char* haystack, int32 length, const char* needle, int32 needle_length, int32 start) {
+    if (needle_length == 0) {
+        return start;
+    }
+    if (needle_length > length - start) {
+        return -1;
+    }
+    if (needle_length == 1) {
+        const char* found = memchr(haystack + start, needle[0], length - start);
+        return found != NULL ? (int32) (found - haystack) : -1;
+    }
+
+    #ifdef TEXT_SIMD
+    return find_blocks(haystack, length, needle, needle_length, start);
+    #else
+    return find_scalar(haystack, length, needle, needle_length, start);
+    #endif
+}
+
+// Counts non-overlapping occurrences of needle. As in text_find(), an
+// empty needle matches before every byte and at the end.
+int32 text_count(const char* haystack, int32 length, const char* needle, int32 needle_length) {
+    if (needle_length == 0) {
+        return length + 1;
+    }
+
+    #ifdef TEXT_SIMD
+    if (needle_length == 1) {
+        return count_byte(haystack, length, needle[0]);
+    }
+    #endif
+
+    int32 count = 0;
+    int32 index = text_find(haystack, length, needle, needle_length, 0);
+    while (index != -1) {
+        count++;
+        index = text_find(haystack, length, needle, needle_length, index + needle_length);
+    }
+    return count;
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Narrows [start, end) to exclude leading and trailing whitespace.
+void text_trim(const char* chars, int32 length, int32* start, int32* end) {
+    *start = 0;
+    *end = length;
+    while (*start < *end && is_space(chars[*start])) {
+        (*start)++;
+    }
+    while (*end > *start && is_space(chars[*end - 1])) {
+        (*end)--;
+    }
+}
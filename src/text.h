@@ -0,0 +1,7 @@
+#pragma once
+
+#include "common.h"
+
+int32 text_find(const char* haystack, int32 length, const char* needle, int32 needle_length, int32 start);
+int32 text_count(const char* haystack, int32 length, const char* needle, int32 needle_length);
+void text_trim(const char* chars, int32 length, int32* start, int32* end);
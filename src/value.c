@@ -36,6 +36,10 @@ void print_value(Value value) {
         printf("nil");
     } else if (is_number(value)) {
         printf("%g", as_number(value));
+    } else if (is_short_string(value)) {
+        char chars[SHORT_STRING_MAX];
+        short_string_chars(value, chars);
+        printf("%.*s", short_string_length(value), chars);
     } else if (is_obj(value)) {
         print_object(value);
     }
@@ -70,7 +74,10 @@ bool values_equal(Value a, Value b) {
     if (is_number(a) && is_number(b)) {
         return as_number(a) == as_number(b);
     }
-    return a == b;
+    if (a == b) {
+        return true;
+    }
+    return is_string(a) && is_string(b) && strings_equal(as_string(a), as_string(b));
 
     #else
 
@@ -88,6 +95,9 @@ bool values_equal(Value a, Value b) {
             return as_number(a) == as_number(b);
         }
         case ValObj: {
+            if (is_string(a) && is_string(b)) {
+                return strings_equal(as_string(a), as_string(b));
+            }
             return as_obj(a) == as_obj(b);
         }
     }
@@ -15,6 +15,11 @@ typedef struct ObjString ObjString;
 #define TAG_FALSE 2
 #define TAG_TRUE 3
 
+// Strings of up to SHORT_STRING_MAX bytes live in the payload: the bytes
+// in bits 0-39, the length in bits 40-42 and TAG_SHORT_STRING above them.
+#define TAG_SHORT_STRING ((uint64) 0x0001000000000000)
+#define SHORT_STRING_MAX 5
+
 typedef uint64 Value;
 
 #else
@@ -119,6 +124,28 @@ static inline Value obj_val(Obj* obj) {
     return (Value) (SIGN_BIT | QNAN | (uint64) (uintptr) obj);
 }
 
+static inline bool is_short_string(Value value) {
+    return (value & (SIGN_BIT | QNAN | TAG_SHORT_STRING)) == (QNAN | TAG_SHORT_STRING);
+}
+
+static inline int32 short_string_length(Value value) {
+    return (int32) ((value >> 40) & 0x7);
+}
+
+static inline void short_string_chars(Value value, char* chars) {
+    for (int32 i = 0; i < short_string_length(value); i++) {
+        chars[i] = (char) (value >> (8 * i));
+    }
+}
+
+static inline Value short_string_val(const char* chars, int32 length) {
+    uint64 bytes = 0;
+    for (int32 i = 0; i < length; i++) {
+        bytes |= (uint64) (uint8) chars[i] << (8 * i);
+    }
+    return (Value) (QNAN | TAG_SHORT_STRING | (uint64) length << 40 | bytes);
+}
+
 #else
 
 static inline bool is_bool(Value value) {
@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
@@ -9,11 +10,14 @@
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "profiler.h"
+#include "text.h"
 #include "vm.h"
 
 VM vm;
 
 static void runtime_error(const char* format, ...);
+static Value peek(int32 distance);
 
 static Value native_clock(int32 arg_count, [[maybe_unused]] Value* _args, bool* success) {
     if (arg_count != 0) {
@@ -43,8 +47,8 @@ static Value native_to_string(int32 arg_count, Value* args, bool* success) {
                 *success = false;
                 return nil_val();
             }
-            reallocate(str, 32, length + 1);
-            return obj_val((Obj*) take_string(str, length));
+            str = reallocate(str, 32, length + 1);
+            return take_string_value(str, length);
         } else {
             char* str = ALLOCATE(char, 64);
             int32 length = snprintf(str, 64, "%g", number);
@@ -54,22 +58,22 @@ static Value native_to_string(int32 arg_count, Value* args, bool* success) {
                 *success = false;
                 return nil_val();
             }
-            reallocate(str, 64, length + 1);
-            return obj_val((Obj*) take_string(str, length));
+            str = reallocate(str, 64, length + 1);
+            return take_string_value(str, length);
         }
     } else if (is_nil(arg)) {
-        return obj_val((Obj*) copy_string("nil", 3));
+        return copy_string_value("nil", 3);
     } else if (is_bool(arg)) {
         bool val = as_bool(arg);
         if (val) {
-            return obj_val((Obj*) copy_string("true", 4));
+            return copy_string_value("true", 4);
         } else {
-            return obj_val((Obj*) copy_string("false", 5));
+            return copy_string_value("false", 5);
         }
+    } else if (is_string_value(arg)) {
+        return arg;
     } else if (is_obj(arg)) {
-        if (is_obj_type(arg, ObjectString)) {
-            return arg;
-        } else if (is_obj_type(arg, ObjectFunction)) {
+        if (is_obj_type(arg, ObjectFunction)) {
             ObjFunction* function = as_function(arg);
             char* str = ALLOCATE(char, 1024);
             int32 length = snprintf(str, 1024, "<fn %s>", function->name->chars);
@@ -79,10 +83,10 @@ static Value native_to_string(int32 arg_count, Value* args, bool* success) {
                 *success = false;
                 return nil_val();
             }
-            reallocate(str, 1024, length + 1);
-            return obj_val((Obj*) take_string(str, length));
+            str = reallocate(str, 1024, length + 1);
+            return take_string_value(str, length);
         } else if (is_obj_type(arg, ObjectNative)) {
-            return obj_val((Obj*) take_string("<native fn>", 11));
+            return copy_string_value("<native fn>", 11);
         }
     }
     return nil_val();  // Unreachable.
@@ -104,8 +108,276 @@ static Value native_readline(int32 arg_count, [[maybe_unused]] Value* _args, boo
     }
     str[strcspn(str, "\n")] = '\0';
     int32 length = strlen(str);
-    reallocate(str, 1024, length + 1);
-    return obj_val((Obj*) take_string(str, length));
+    str = reallocate(str, 1024, length + 1);
+    return take_string_value(str, length);
+}
+
+static bool check_arg_count(int32 arg_count, int32 expected, bool* success) {
+    if (arg_count != expected) {
+        runtime_error("Expected %d arguments but got %d.", expected, arg_count);
+        *success = false;
+        return false;
+    }
+    return true;
+}
+
+// Ropes are flattened in place, since `args` points into the VM stack.
+static bool string_arg(Value* args, int32 index, StringChars* chars, bool* success) {
+    if (is_rope(args[index])) {
+        args[index] = obj_val((Obj*) flatten_rope(as_rope(args[index])));
+    }
+    if (!is_string_value(args[index])) {
+        runtime_error("Argument %d must be a string.", index + 1);
+        *success = false;
+        return false;
+    }
+    string_value_chars(args[index], chars);
+    return true;
+}
+
+static bool index_arg(Value* args, int32 index, int32 min, int32 max, int32* result, bool* success) {
+    if (!is_number(args[index])) {
+        runtime_error("Argument %d must be a number.", index + 1);
+        *success = false;
+        return false;
+    }
+    float64 number = as_number(args[index]);
+    if (number != floor(number) || number < min || number > max) {
+        runtime_error("Argument %d is out of range.", index + 1);
+        *success = false;
+        return false;
+    }
+    *result = (int32) number;
+    return true;
+}
+
+static Value native_substr(int32 arg_count, Value* args, bool* success) {
+    if (!check_arg_count(arg_count, 3, success)) {
+        return nil_val();
+    }
+    StringChars string;
+    int32 start;
+    int32 length;
+    if (!string_arg(args, 0, &string, success)
+        || !index_arg(args, 1, 0, string.length, &start, success)
+        || !index_arg(args, 2, 0, string.length - start, &length, success)) {
+        return nil_val();
+    }
+    return slice_string_value(&string, start, length);
+}
+
+static Value native_char_at(int32 arg_count, Value* args, bool* success) {
+    if (!check_arg_count(arg_count, 2, success)) {
+        return nil_val();
+    }
+    StringChars string;
+    int32 index;
+    if (!string_arg(args, 0, &string, success) || !index_arg(args, 1, 0, string.length - 1, &index, success)) {
+        return nil_val();
+    }
+    return copy_string_value(string.chars + index, 1);
+}
+
+static int32 find_chars(StringChars* haystack, StringChars* needle, int32 start) {
+    return text_find(haystack->chars, haystack->length, needle->chars, needle->length, start);
+}
+
+// find(string, needle) or find(string, needle, start). Returns -1 when
+// the needle does not occur.
+static Value native_find(int32 arg_count, Value* args, bool* success) {
+    if (arg_count != 2 && arg_count != 3) {
+        runtime_error("Expected 2 or 3 arguments but got %d.", arg_count);
+        *success = false;
+        return nil_val();
+    }
+    StringChars string;
+    StringChars needle;
+    int32 start = 0;
+    if (!string_arg(args, 0, &string, success)
+        || !string_arg(args, 1, &needle, success)
+        || (arg_count == 3 && !index_arg(args, 2, 0, string.length, &start, success))) {
+        return nil_val();
+    }
+    return number_val(find_chars(&string, &needle, start));
+}
+
+// Returns the parts as a list of StringList instances linked through
+// their `next` field, each holding a view in `value`.
+static Value native_split(int32 arg_count, Value* args, bool* success) {
+    if (!check_arg_count(arg_count, 2, success)) {
+        return nil_val();
+    }
+    StringChars string;
+    StringChars separator;
+    if (!string_arg(args, 0, &string, success) || !string_arg(args, 1, &separator, success)) {
+        return nil_val();
+    }
+
+    push(obj_val((Obj*) copy_string("value", 5)));
+    push(obj_val((Obj*) copy_string("next", 4)));
+    push(nil_val());
+    ObjString* value_name = as_string(peek(2));
+    ObjString* next_name = as_string(peek(1));
+
+    ObjInstance* tail = NULL;
+    int32 start = 0;
+    while (true) {
+        int32 end;
+        if (separator.length == 0) {
+            // An empty separator splits off one character at a time.
+            end = start + 1 < string.length ? start + 1 : -1;
+        } else {
+            end = find_chars(&string, &separator, start);
+        }
+        int32 length = (end == -1 ? string.length : end) - start;
+
+        push(slice_string_value(&string, start, length));
+        ObjInstance* node = new_instance(vm.string_list_class);
+        push(obj_val((Obj*) node));
+        table_set(&node->fields, value_name, peek(1));
+        table_set(&node->fields, next_name, nil_val());
+        if (tail == NULL) {
+            vm.stack_top[-3] = peek(0);
+        } else {
+            table_set(&tail->fields, next_name, peek(0));
+        }
+        pop();
+        pop();
+        tail = node;
+
+        if (end == -1) {
+            break;
+        }
+        start = end + separator.length;
+    }
+
+    Value head = pop();
+    vm.stack_top -= 2;
+    return head;
+}
+
+static Value native_length(int32 arg_count, Value* args, bool* success) {
+    if (!check_arg_count(arg_count, 1, success)) {
+        return nil_val();
+    }
+    if (!is_string_value(args[0])) {
+        runtime_error("Argument 1 must be a string.");
+        *success = false;
+        return nil_val();
+    }
+    return number_val(string_value_length(args[0]));
+}
+
+static Value native_count(int32 arg_count, Value* args, bool* success) {
+    if (!check_arg_count(arg_count, 2, success)) {
+        return nil_val();
+    }
+    StringChars string;
+    StringChars needle;
+    if (!string_arg(args, 0, &string, success) || !string_arg(args, 1, &needle, success)) {
+        return nil_val();
+    }
+    return number_val(text_count(string.chars, string.length, needle.chars, needle.length));
+}
+
+static Value native_trim(int32 arg_count, Value* args, bool* success) {
+    if (!check_arg_count(arg_count, 1, success)) {
+        return nil_val();
+    }
+    StringChars string;
+    if (!string_arg(args, 0, &string, success)) {
+        return nil_val();
+    }
+    int32 start;
+    int32 end;
+    text_trim(string.chars, string.length, &start, &end);
+    if (start == 0 && end == string.length) {
+        return args[0];
+    }
+    return slice_string_value(&string, start, end - start);
+}
+
+// replace(string, old, new) replaces every non-overlapping occurrence.
+static Value native_replace(int32 arg_count, Value* args, bool* success) {
+    if (!check_arg_count(arg_count, 3, success)) {
+        return nil_val();
+    }
+    StringChars string;
+    StringChars old;
+    StringChars new;
+    if (!string_arg(args, 0, &string, success)
+        || !string_arg(args, 1, &old, success)
+        || !string_arg(args, 2, &new, success)) {
+        return nil_val();
+    }
+    int32 count = text_count(string.chars, string.length, old.chars, old.length);
+    if (count == 0) {
+        return args[0];
+    }
+
+    int32 length = string.length + count * (new.length - old.length);
+    char* chars = ALLOCATE(char, length + 1);
+    char* out = chars;
+    int32 start = 0;
+    for (int32 i = 0; i < count; i++) {
+        int32 index = find_chars(&string, &old, start);
+        memcpy(out, string.chars + start, index - start);
+        out += index - start;
+        memcpy(out, new.chars, new.length);
+        out += new.length;
+        start = index + old.length;
+        // An empty pattern matches again where it was found, so step over
+        // a character to reach the next match.
+        if (old.length == 0 && start < string.length) {
+            *out++ = string.chars[start++];
+        }
+    }
+    memcpy(out, string.chars + start, string.length - start);
+    chars[length] = '\0';
+    return take_string_value(chars, length);
+}
+
+static void set_stat_field(ObjInstance* instance, const char* name, float64 value) {
+    push(obj_val((Obj*) copy_string(name, (int32) strlen(name))));
+    table_set(&instance->fields, as_string(peek(0)), number_val(value));
+    pop();
+}
+
+static Value native_gc_stats(int32 arg_count, [[maybe_unused]] Value* _args, bool* success) {
+    if (arg_count != 0) {
+        runtime_error("Expected 0 arguments but got %d.", arg_count);
+        *success = false;
+        return nil_val();
+    }
+
+    GcStats* stats = &vm.gc_stats;
+    ObjInstance* instance = new_instance(vm.gc_stats_class);
+    push(obj_val((Obj*) instance));
+
+    set_stat_field(instance, "collections", stats->collections);
+    set_stat_field(instance, "bytes_allocated", (float64) vm.bytes_allocated);
+    set_stat_field(instance, "bytes_freed", (float64) stats->bytes_freed);
+    set_stat_field(instance, "next_gc", (float64) vm.next_gc);
+    set_stat_field(instance, "pause_total_ms", (float64) stats->pause_total_ns / 1e6);
+    set_stat_field(instance, "pause_max_ms", (float64) stats->pause_max_ns / 1e6);
+
+    set_stat_field(instance, "bound_method_pool_hit_rate", pool_hit_rate(&vm.bound_method_pool));
+    set_stat_field(instance, "upvalue_pool_hit_rate", pool_hit_rate(&vm.upvalue_pool));
+
+    char name[64];
+    for (int32 i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        snprintf(name, sizeof(name), "pause_%s", gc_pause_bucket_name(i));
+        set_stat_field(instance, name, stats->pause_histogram[i]);
+    }
+    for (int32 i = 0; i < OBJ_TYPE_COUNT; i++) {
+        snprintf(name, sizeof(name), "live_%s_objects", obj_type_name((ObjType) i));
+        set_stat_field(instance, name, stats->live_objects[i]);
+        snprintf(name, sizeof(name), "live_%s_bytes", obj_type_name((ObjType) i));
+        set_stat_field(instance, name, (float64) stats->live_bytes[i]);
+    }
+
+    pop();
+    return obj_val((Obj*) instance);
 }
 
 static void reset_stack() {
@@ -125,8 +397,17 @@ static void runtime_error(const char* format, ...) {
     for (int32 i = vm.frame_count - 1; i >= 0; i--) {
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
-        usize instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        int32 instruction = (int32) (frame->ip - function->chunk.code - 1);
+        int32 line = function->chunk.lines[instruction];
+        for (int32 j = 0; j < function->chunk.inline_count; j++) {
+            InlineSite* site = &function->chunk.inline_sites[j];
+            if (instruction >= site->start && instruction < site->end) {
+                fprintf(stderr, "[line %d] in %s()\n", line, site->name->chars);
+                line = site->line;
+                break;
+            }
+        }
+        fprintf(stderr, "[line %d] in ", line);
         if (function->name == NULL) {
             fprintf(stderr, "<script>\n");
         } else {
@@ -137,6 +418,29 @@ static void runtime_error(const char* format, ...) {
     reset_stack();
 }
 
+void out_of_memory_error(usize requested) {
+    if (vm.error_jump == NULL) {
+        fprintf(stderr, "Out of memory: could not allocate %zu bytes.\n", requested);
+        exit(1);
+    }
+
+    if (vm.heap_config.max_heap != 0) {
+        runtime_error("Out of memory: could not allocate %zu bytes within the %zu byte heap limit.", requested, vm.heap_config.max_heap);
+    } else {
+        runtime_error("Out of memory: could not allocate %zu bytes.", requested);
+    }
+    longjmp(*vm.error_jump, 1);
+}
+
+// Classes of the instances natives return. They are created once, and
+// not bound to a global.
+static ObjClass* native_class(const char* name) {
+    push(obj_val((Obj*) copy_string(name, (int32) strlen(name))));
+    ObjClass* class = new_class(as_string(peek(0)));
+    pop();
+    return class;
+}
+
 static void define_native(const char* name, NativeFn function) {
     push(obj_val((Obj*) copy_string(name, (int32) strlen(name))));
     push(obj_val((Obj*) new_native(function)));
@@ -149,28 +453,59 @@ void init_vm() {
     reset_stack();
     vm.objects = NULL;
     vm.bytes_allocated = 0;
-    vm.next_gc = 1024 * 1024;
+    vm.error_jump = NULL;
+    HeapConfig config;
+    init_heap_config(&config);
+    configure_heap(&config);
+    init_gc_stats(&vm.gc_stats);
+    init_pool(&vm.bound_method_pool);
+    init_pool(&vm.upvalue_pool);
+    vm.profile_allocations = false;
+    vm.optimize = false;
+    vm.repl = false;
+    init_profiler();
 
     vm.gray_count = 0;
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
+    vm.view_count = 0;
+    vm.view_capacity = 0;
+    vm.views = NULL;
 
     init_table(&vm.globals);
-    init_table(&vm.strings);
+    seed_string_hash();
+    init_intern_set(&vm.strings);
 
     vm.init_string = NULL;
+    vm.gc_stats_class = NULL;
+    vm.string_list_class = NULL;
     vm.init_string = copy_string("init", 4);
+    vm.gc_stats_class = native_class("GcStats");
+    vm.string_list_class = native_class("StringList");
 
     define_native("clock", native_clock);
     define_native("to_string", native_to_string);
     define_native("readline", native_readline);
+    define_native("gc_stats", native_gc_stats);
+    define_native("substr", native_substr);
+    define_native("char_at", native_char_at);
+    define_native("find", native_find);
+    define_native("index_of", native_find);
+    define_native("length", native_length);
+    define_native("count", native_count);
+    define_native("trim", native_trim);
+    define_native("replace", native_replace);
+    define_native("split", native_split);
 }
 
 void free_vm() {
     free_table(&vm.globals);
-    free_table(&vm.strings);
+    free_intern_set(&vm.strings);
     vm.init_string = NULL;
+    vm.gc_stats_class = NULL;
+    vm.string_list_class = NULL;
     free_objects();
+    free_profiler();
 }
 
 void push(Value value) {
@@ -189,7 +524,8 @@ static Value peek(int32 distance) {
 
 static bool call(ObjClosure* closure, int32 arg_count) {
     if (arg_count != closure->function->arity) {
-        runtime_error("Expected %d arguments but got %d.", closure->function->arity, arg_count);
+        int32 lifted = closure->function->lifted;
+        runtime_error("Expected %d arguments but got %d.", closure->function->arity - lifted, arg_count - lifted);
         return false;
     }
     if (vm.frame_count == FRAMES_MAX) {
@@ -243,12 +579,30 @@ static bool call_value(Value callee, int32 arg_count) {
     return false;
 }
 
+// A getter is answered without a frame when its field is set. Otherwise
+// it runs, and reports the missing field itself.
+static bool inline_getter(ObjClosure* closure, int32 arg_count) {
+    ObjString* field = closure->function->getter;
+    if (field == NULL || arg_count != 0) {
+        return false;
+    }
+    Value value;
+    if (!table_get(&as_instance(peek(0))->fields, field, &value)) {
+        return false;
+    }
+    vm.stack_top[-1] = value;
+    return true;
+}
+
 static bool invoke_from_class(ObjClass* class, ObjString* name, int32 arg_count) {
     Value method;
     if (!table_get(&class->methods, name, &method)) {
         runtime_error("Undefined property `%s`.", name->chars);
         return false;
     }
+    if (inline_getter(as_closure(method), arg_count)) {
+        return true;
+    }
     return call(as_closure(method), arg_count);
 }
 
@@ -308,6 +662,61 @@ static void close_upvalues(Value* last) {
     }
 }
 
+// Runs `closure` in the current frame instead of pushing a new one. The
+// callee and its arguments slide down over the frame's slots once its
+// upvalues are closed.
+static bool tail_call(ObjClosure* closure, int32 arg_count) {
+    if (arg_count != closure->function->arity) {
+        int32 lifted = closure->function->lifted;
+        runtime_error("Expected %d arguments but got %d.", closure->function->arity - lifted, arg_count - lifted);
+        return false;
+    }
+    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    close_upvalues(frame->slots);
+    memmove(frame->slots, vm.stack_top - arg_count - 1, sizeof(Value) * (arg_count + 1));
+    vm.stack_top = frame->slots + arg_count + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
+// Anything but a function or method is called normally, and the OpReturn
+// after the tail call returns its result.
+static bool tail_call_value(Value callee, int32 arg_count) {
+    if (is_closure(callee)) {
+        return tail_call(as_closure(callee), arg_count);
+    }
+    if (is_bound_method(callee)) {
+        ObjBoundMethod* bound = as_bound_method(callee);
+        vm.stack_top[-arg_count - 1] = bound->receiver;
+        return tail_call(bound->method, arg_count);
+    }
+    return call_value(callee, arg_count);
+}
+
+static bool tail_invoke(ObjString* name, int32 arg_count) {
+    Value receiver = peek(arg_count);
+    if (!is_instance(receiver)) {
+        runtime_error("Only instances have methods.");
+        return false;
+    }
+    ObjInstance* instance = as_instance(receiver);
+
+    Value value;
+    if (table_get(&instance->fields, name, &value)) {
+        vm.stack_top[-arg_count - 1] = value;
+        return tail_call_value(value, arg_count);
+    }
+    if (!table_get(&instance->class->methods, name, &value)) {
+        runtime_error("Undefined property `%s`.", name->chars);
+        return false;
+    }
+    if (inline_getter(as_closure(value), arg_count)) {
+        return true;
+    }
+    return tail_call(as_closure(value), arg_count);
+}
+
 static void define_method(ObjString* name) {
     Value method = peek(0);
     ObjClass* class = as_class(peek(1));
@@ -319,20 +728,55 @@ static bool is_falsy(Value value) {
     return is_nil(value) || (is_bool(value) && !as_bool(value));
 }
 
+// Replaces a rope on the stack with its flattened string.
+static void flatten_slot(int32 distance) {
+    Value value = peek(distance);
+    if (is_rope(value)) {
+        vm.stack_top[-1 - distance] = obj_val((Obj*) flatten_rope(as_rope(value)));
+    }
+}
+
+// Concatenations shorter than ROPE_MIN_LENGTH are copied right away, since
+// a rope node would cost more than the copy. Longer ones make a rope, so
+// building a string piece by piece is linear. A right half nested
+// ROPE_MAX_DEPTH deep is flattened to bound the recursion in copy_rope().
+#define ROPE_MIN_LENGTH 64
+#define ROPE_MAX_DEPTH 256
+
 static void concatenate() {
-    ObjString* b = as_string(peek(0));
-    ObjString* a = as_string(peek(1));
+    int32 length = string_value_length(peek(1)) + string_value_length(peek(0));
+    if (length >= ROPE_MIN_LENGTH) {
+        if (is_rope(peek(0)) && as_rope(peek(0))->depth >= ROPE_MAX_DEPTH) {
+            flatten_slot(0);
+        }
+        ObjRope* rope = new_rope(peek(1), peek(0));
+        pop();
+        pop();
+        push(obj_val((Obj*) rope));
+        return;
+    }
 
-    int32 length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    StringChars a;
+    StringChars b;
+    string_value_chars(peek(1), &a);
+    string_value_chars(peek(0), &b);
 
-    ObjString* result = take_string(chars, length);
+    Value result;
+    if (fits_short_string(length)) {
+        char chars[8];
+        memcpy(chars, a.chars, a.length);
+        memcpy(chars + a.length, b.chars, b.length);
+        result = copy_string_value(chars, length);
+    } else {
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, a.chars, a.length);
+        memcpy(chars + a.length, b.chars, b.length);
+        chars[length] = '\0';
+        result = take_string_value(chars, length);
+    }
     pop();
     pop();
-    push(obj_val((Obj*) result));
+    push(result);
 }
 
 static InterpretResult run() {
@@ -354,6 +798,26 @@ static InterpretResult run() {
         float64 a = as_number(pop()); \
         push(value_type(a op b)); \
     } while (false);
+// The compiler has proven that both operands are numbers.
+#define NUMBER_OP(op) \
+    do { \
+        float64 b = as_number(pop()); \
+        float64 a = as_number(pop()); \
+        push(number_val(a op b)); \
+    } while (false);
+#define JUMP_UNLESS(op) \
+    do { \
+        uint16 offset = READ_SHORT(); \
+        if (!is_number(peek(0)) || !is_number(peek(1))) { \
+            runtime_error("Operands must be numbers."); \
+            return InterpretRuntimeError; \
+        } \
+        float64 b = as_number(pop()); \
+        float64 a = as_number(pop()); \
+        if (!(a op b)) { \
+            frame->ip += offset; \
+        } \
+    } while (false);
 
     CallFrame* frame = &vm.frames[vm.frame_count - 1];
 
@@ -427,6 +891,24 @@ static InterpretResult run() {
                 }
                 break;
             }
+            case OpHoistGlobal: {
+                ObjString* name = READ_STRING();
+                Value value;
+                push(table_get(&vm.globals, name, &value) ? value : nil_val());
+                break;
+            }
+            case OpGetHoisted: {
+                uint8 slot = READ_BYTE();
+                ObjString* name = READ_STRING();
+                Value value = frame->slots[slot];
+                // Nil may also mean the global was undefined when it was hoisted.
+                if (is_nil(value) && !table_get(&vm.globals, name, &value)) {
+                    runtime_error("Undefined variable `%s`.", name->chars);
+                    return InterpretRuntimeError;
+                }
+                push(value);
+                break;
+            }
             case OpGetUpvalue: {
                 uint8 slot = READ_BYTE();
                 push(*frame->closure->upvalues[slot]->location);
@@ -437,6 +919,10 @@ static InterpretResult run() {
                 *frame->closure->upvalues[slot]->location = peek(0);
                 break;
             }
+            case OpGetCopied: {
+                push(frame->closure->copied[READ_BYTE()]);
+                break;
+            }
             case OpGetProperty: {
                 if (!is_instance(peek(0))) {
                     runtime_error("Only instances have properties.");
@@ -476,21 +962,52 @@ static InterpretResult run() {
                 break;
             }
             case OpEqual: {
+                flatten_slot(0);
+                flatten_slot(1);
                 Value b = pop();
                 Value a = pop();
                 push(bool_val(values_equal(a, b)));
                 break;
             }
+            case OpNotEqual: {
+                flatten_slot(0);
+                flatten_slot(1);
+                Value b = pop();
+                Value a = pop();
+                push(bool_val(!values_equal(a, b)));
+                break;
+            }
             case OpGreater: {
                 BINARY_OP(bool_val, >);
                 break;
             }
+            case OpGreaterEqual: {
+                // Same as OpLess followed by OpNot, which differs from >= for NaN.
+                if (!is_number(peek(0)) || !is_number(peek(1))) {
+                    runtime_error("Operands must be numbers.");
+                    return InterpretRuntimeError;
+                }
+                float64 b = as_number(pop());
+                float64 a = as_number(pop());
+                push(bool_val(!(a < b)));
+                break;
+            }
             case OpLess: {
                 BINARY_OP(bool_val, <);
                 break;
             }
+            case OpLessEqual: {
+                if (!is_number(peek(0)) || !is_number(peek(1))) {
+                    runtime_error("Operands must be numbers.");
+                    return InterpretRuntimeError;
+                }
+                float64 b = as_number(pop());
+                float64 a = as_number(pop());
+                push(bool_val(!(a > b)));
+                break;
+            }
             case OpAdd: {
-                if (is_string(peek(0)) && is_string(peek(1))) {
+                if (is_string_value(peek(0)) && is_string_value(peek(1))) {
                     concatenate();
                 } else if (is_number(peek(0)) && is_number(peek(1))) {
                     float64 b = as_number(pop());
@@ -514,6 +1031,22 @@ static InterpretResult run() {
                 BINARY_OP(number_val, /);
                 break;
             }
+            case OpAddNumber: {
+                NUMBER_OP(+);
+                break;
+            }
+            case OpSubtractNumber: {
+                NUMBER_OP(-);
+                break;
+            }
+            case OpMultiplyNumber: {
+                NUMBER_OP(*);
+                break;
+            }
+            case OpDivideNumber: {
+                NUMBER_OP(/);
+                break;
+            }
             case OpNot: {
                 push(bool_val(is_falsy(pop())));
                 break;
@@ -526,7 +1059,12 @@ static InterpretResult run() {
                 push(number_val(-as_number(pop())));
                 break;
             }
+            case OpNegateNumber: {
+                push(number_val(-as_number(pop())));
+                break;
+            }
             case OpPrint: {
+                flatten_slot(0);
                 print_value(pop());
                 printf("\n");
                 break;
@@ -543,11 +1081,76 @@ static InterpretResult run() {
                 }
                 break;
             }
+            case OpJumpIfNotLess: {
+                JUMP_UNLESS(<);
+                break;
+            }
+            case OpJumpIfNotGreater: {
+                JUMP_UNLESS(>);
+                break;
+            }
+            case OpJumpIfNotEqual: {
+                uint16 offset = READ_SHORT();
+                if (is_number(peek(0)) && is_number(peek(1))) {
+                    float64 b = as_number(pop());
+                    float64 a = as_number(pop());
+                    if (!(a == b)) {
+                        frame->ip += offset;
+                    }
+                    break;
+                }
+                flatten_slot(0);
+                flatten_slot(1);
+                Value b = pop();
+                Value a = pop();
+                if (!values_equal(a, b)) {
+                    frame->ip += offset;
+                }
+                break;
+            }
             case OpLoop: {
                 uint16 offset = READ_SHORT();
                 frame->ip -= offset;
                 break;
             }
+            case OpForLoop: {
+                // The first test of the loop already checked that the
+                // counter and bound are numbers, and neither is assigned
+                // anywhere else.
+                Value* counter = &frame->slots[READ_BYTE()];
+                float64 step = as_number(READ_CONSTANT());
+                uint8 bound = READ_BYTE();
+                uint8 mode = READ_BYTE();
+                uint16 offset = READ_SHORT();
+
+                float64 limit = as_number(mode & ForLocalBound ? frame->slots[bound] : frame->closure->function->chunk.constants.values[bound]);
+                float64 value = as_number(*counter) + step;
+                *counter = number_val(value);
+
+                bool repeat;
+                switch (mode & ~ForLocalBound) {
+                    case ForLess: {
+                        repeat = value < limit;
+                        break;
+                    }
+                    case ForLessEqual: {
+                        repeat = !(value > limit);
+                        break;
+                    }
+                    case ForGreater: {
+                        repeat = value > limit;
+                        break;
+                    }
+                    default: {
+                        repeat = !(value < limit);
+                        break;
+                    }
+                }
+                if (repeat) {
+                    frame->ip -= offset;
+                }
+                break;
+            }
             case OpCall: {
                 int32 arg_count = READ_BYTE();
                 if (!call_value(peek(arg_count), arg_count)) {
@@ -556,6 +1159,27 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frame_count - 1];
                 break;
             }
+            case OpInlineGuard: {
+                // The inlined body follows for as long as the callee is
+                // still the function it was copied from.
+                ObjFunction* function = as_function(READ_CONSTANT());
+                uint16 offset = READ_SHORT();
+                Value callee = peek(0);
+                if (is_closure(callee) && as_closure(callee)->function == function) {
+                    pop();
+                } else {
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OpTailCall: {
+                int32 arg_count = READ_BYTE();
+                if (!tail_call_value(peek(arg_count), arg_count)) {
+                    return InterpretRuntimeError;
+                }
+                frame = &vm.frames[vm.frame_count - 1];
+                break;
+            }
             case OpInvoke: {
                 ObjString* method = READ_STRING();
                 int32 arg_count = READ_BYTE();
@@ -565,6 +1189,15 @@ static InterpretResult run() {
                 frame = &vm.frames[vm.frame_count - 1];
                 break;
             }
+            case OpTailInvoke: {
+                ObjString* method = READ_STRING();
+                int32 arg_count = READ_BYTE();
+                if (!tail_invoke(method, arg_count)) {
+                    return InterpretRuntimeError;
+                }
+                frame = &vm.frames[vm.frame_count - 1];
+                break;
+            }
             case OpSuperInvoke: {
                 ObjString* method = READ_STRING();
                 int32 arg_count = READ_BYTE();
@@ -588,6 +1221,11 @@ static InterpretResult run() {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
                 }
+                for (int32 i = 0; i < closure->copied_count; i++) {
+                    bool is_local = READ_BYTE() != 0;
+                    uint8 index = READ_BYTE();
+                    closure->copied[i] = is_local ? frame->slots[index] : frame->closure->copied[index];
+                }
                 break;
             }
             case OpCloseUpvalue: {
@@ -635,6 +1273,8 @@ static InterpretResult run() {
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef JUMP_UNLESS
 }
 
 InterpretResult interpret(const char* source) {
@@ -643,11 +1283,22 @@ InterpretResult interpret(const char* source) {
         return InterpretCompileError;
     }
 
-    push(obj_val((Obj*) function));
-    ObjClosure* closure = new_closure(function);
-    pop();
-    push(obj_val((Obj*) function));
-    call(closure, 0);
+    jmp_buf error_jump;
+    vm.error_jump = &error_jump;
+
+    InterpretResult result;
+    if (setjmp(error_jump) == 0) {
+        push(obj_val((Obj*) function));
+        ObjClosure* closure = new_closure(function);
+        pop();
+        push(obj_val((Obj*) function));
+        call(closure, 0);
+
+        result = run();
+    } else {
+        result = InterpretRuntimeError;
+    }
 
-    return run();
+    vm.error_jump = NULL;
+    return result;
 }
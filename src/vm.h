@@ -1,5 +1,9 @@
 #pragma once
 
+#include <setjmp.h>
+
+#include "intern.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -19,15 +23,30 @@ typedef struct {
     Value stack[STACK_MAX];
     Value* stack_top;
     Table globals;
-    Table strings;
+    InternSet strings;
     ObjString* init_string;
+    ObjClass* gc_stats_class;
+    ObjClass* string_list_class;
     ObjUpvalue* open_upvalues;
     usize bytes_allocated;
     usize next_gc;
+    HeapConfig heap_config;
+    jmp_buf* error_jump;
     Obj* objects;
     int32 gray_count;
     int32 gray_capacity;
     Obj** gray_stack;
+    int32 view_count;
+    int32 view_capacity;
+    ObjString** views;
+    GcStats gc_stats;
+    ObjPool bound_method_pool;
+    ObjPool upvalue_pool;
+    bool profile_allocations;
+    bool optimize;
+    // Each line is compiled on its own, so no line can see the code of
+    // the lines that follow it.
+    bool repl;
 } VM;
 
 typedef enum {
@@ -43,3 +62,4 @@ void free_vm();
 InterpretResult interpret(const char* source);
 void push(Value value);
 Value pop();
+void out_of_memory_error(usize requested);
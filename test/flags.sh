@@ -0,0 +1,116 @@
+#!/bin/sh
+# Tests command-line flags and environment variables, which test/run.sh
+# can't pass to a script.
+#
+# Usage: test/flags.sh <clox>
+#
+# The heap sizing checks read the first collection threshold, so <clox>
+# must not be a DEBUG_STRESS_GC build.
+
+clox=${1:?usage: test/flags.sh <clox>}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+failed=0
+
+# fail <name> <problem>
+fail() {
+    echo "FAIL $1 - $2"
+    failed=$((failed + 1))
+}
+
+# expect_status <name> <expected> <actual>
+expect_status() {
+    if [ "$3" -ne "$2" ]; then
+        fail "$1" "exit code $3 instead of $2"
+    fi
+}
+
+# expect_match <name> <file> <pattern>
+expect_match() {
+    if ! grep -q -- "$3" "$2"; then
+        fail "$1" "no line matching \"$3\""
+    fi
+}
+
+# expect_output <name> <file> <expected>
+expect_output() {
+    if [ "$(cat "$2")" != "$3" ]; then
+        fail "$1" "printed \"$(cat "$2")\" instead of \"$3\""
+    fi
+}
+
+# --gc-stats writes a JSON report to stderr after the script's output.
+cat > "$work/gc.lox" <<'LOX'
+var list = nil;
+for (var i = 0; i < 1000; i = i + 1) list = "x" + to_string(i);
+print "done";
+LOX
+"$clox" --gc-stats "$work/gc.lox" > "$work/out" 2> "$work/err"
+expect_status gc-stats 0 $?
+expect_match gc-stats "$work/out" '^done$'
+expect_match gc-stats "$work/err" '"collections": '
+expect_match gc-stats "$work/err" '"hit_rate": '
+if command -v python3 > /dev/null; then
+    python3 -c 'import json, sys; json.load(sys.stdin)' < "$work/err" || fail gc-stats "stderr is not valid JSON"
+else
+    echo "SKIP gc-stats JSON check, python3 not found"
+fi
+
+# Heap sizes take K, M and G suffixes. The initial size is the first
+# collection threshold.
+cat > "$work/next_gc.lox" <<'LOX'
+print gc_stats().next_gc / 1024 / 1024;
+LOX
+"$clox" --heap-initial=64K "$work/next_gc.lox" > "$work/out"
+expect_output heap-k "$work/out" 0.0625
+"$clox" --heap-initial=2m "$work/next_gc.lox" > "$work/out"
+expect_output heap-m "$work/out" 2
+"$clox" --heap-initial=1G "$work/next_gc.lox" > "$work/out"
+expect_output heap-g "$work/out" 1024
+
+# CLOX_HEAP_* variables apply unless a flag overrides them.
+CLOX_HEAP_INITIAL=3M "$clox" "$work/next_gc.lox" > "$work/out"
+expect_output heap-env "$work/out" 3
+CLOX_HEAP_INITIAL=3M "$clox" --heap-initial=4M "$work/next_gc.lox" > "$work/out"
+expect_output heap-flag-over-env "$work/out" 4
+
+"$clox" --heap-initial=lots "$work/next_gc.lox" > /dev/null 2> "$work/err"
+expect_status heap-bad-flag 64 $?
+CLOX_HEAP_MAX=lots "$clox" "$work/next_gc.lox" > /dev/null 2> "$work/err"
+expect_status heap-bad-env 64 $?
+expect_match heap-bad-env "$work/err" 'Invalid value "lots" for CLOX_HEAP_MAX.'
+"$clox" --heap-min=2M --heap-max=1M "$work/next_gc.lox" > /dev/null 2> "$work/err"
+expect_status heap-min-over-max 64 $?
+
+# Running into --heap-max is a runtime error with a stack trace.
+cat > "$work/runaway.lox" <<'LOX'
+fun grow() {
+    var s = "";
+    while (true) s = s + "abcdefghijklmnopqrstuvwxyz";
+}
+print "start";
+grow();
+LOX
+"$clox" --heap-max=1M "$work/runaway.lox" > "$work/out" 2> "$work/err"
+expect_status heap-max 70 $?
+expect_output heap-max "$work/out" start
+expect_match heap-max "$work/err" '^Out of memory: could not allocate [0-9]* bytes within the 1048576 byte heap limit\.$'
+expect_match heap-max "$work/err" '^\[line 3\] in grow()$'
+expect_match heap-max "$work/err" '^\[line 6\] in <script>$'
+CLOX_HEAP_MAX=1M "$clox" "$work/runaway.lox" > /dev/null 2> "$work/err"
+expect_status heap-max-env 70 $?
+
+# The REPL reports the error and reads the next line.
+printf '%s\n' 'var s = ""; while (true) s = s + "abcdefghijklmnopqrstuvwxyz";' 's = nil;' 'print "alive";' \
+    | "$clox" --heap-max=1M > "$work/out" 2> "$work/err"
+expect_status heap-max-repl 0 $?
+expect_match heap-max-repl "$work/err" '^Out of memory'
+expect_match heap-max-repl "$work/out" 'alive'
+
+if [ $failed -ne 0 ]; then
+    echo "$failed failed"
+    exit 1
+fi
+echo "All flag tests passed."
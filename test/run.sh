@@ -0,0 +1,70 @@
+#!/bin/sh
+# Runs Lox test scripts against a clox binary, once as is and once with -O.
+#
+# Usage: test/run.sh <clox> [test.lox...]
+#
+# With no scripts given, every test/*.lox is run. Scripts use the
+# annotations of the Crafting Interpreters test suite, plus one for stack
+# traces:
+#
+#   // expect: <line>                   a line the script prints, in order
+#   // expect runtime error: <message>  the script stops with this error,
+#                                       raised from the annotated line
+#   // expect trace: <line>             one line of the stack trace; if any
+#                                       are given, they must be all of it
+
+clox=${1:?usage: test/run.sh <clox> [test.lox...]}
+shift
+if [ $# -eq 0 ]; then
+    set -- "$(dirname "$0")"/*.lox
+fi
+
+errors=$(mktemp)
+trap 'rm -f "$errors"' EXIT
+
+failed=0
+for test in "$@"; do
+    expected=$(sed -n 's|.*// expect: ||p' "$test")
+    error=$(grep -n '// expect runtime error: ' "$test" | head -n 1)
+    error_line=${error%%:*}
+    error_message=$(printf '%s' "$error" | sed 's|.*// expect runtime error: ||')
+    trace=$(sed -n 's|.*// expect trace: ||p' "$test")
+
+    for flag in "" -O; do
+        actual=$("$clox" $flag "$test" 2>"$errors")
+        status=$?
+        problem=""
+        if [ "$actual" != "$expected" ]; then
+            problem="output differs"
+        elif [ -z "$error" ] && [ $status -ne 0 ]; then
+            problem="exit code $status"
+        elif [ -n "$error" ] && [ $status -ne 70 ]; then
+            problem="exit code $status instead of a runtime error"
+        elif [ -n "$error" ] && [ "$(sed -n 1p "$errors")" != "$error_message" ]; then
+            problem="runtime error differs"
+        elif [ -n "$error" ] && ! sed -n 2p "$errors" | grep -q "^\[line $error_line\]"; then
+            problem="runtime error not raised from line $error_line"
+        elif [ -n "$trace" ] && [ "$(sed -n '2,$p' "$errors")" != "$trace" ]; then
+            problem="stack trace differs"
+        fi
+
+        if [ -n "$problem" ]; then
+            echo "FAIL $test ${flag:+($flag) }- $problem"
+            echo "--- expected"
+            printf '%s\n' "$expected"
+            if [ -n "$error" ]; then
+                printf '%s\n' "$error_message" "${trace:-[line $error_line]}"
+            fi
+            echo "--- actual"
+            printf '%s\n' "$actual"
+            cat "$errors"
+            failed=$((failed + 1))
+        fi
+    done
+done
+
+if [ $failed -ne 0 ]; then
+    echo "$failed failed"
+    exit 1
+fi
+echo "All tests passed."
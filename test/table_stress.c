@@ -0,0 +1,70 @@
+// Collision stress test for string hashing. It brute-forces keys whose
+// FNV-1a hashes all share one home slot, the way an attacker would against
+// an unseeded hash, and checks that the seeded hash still spreads them out.
+//
+// Built with STRING_HASH_FNV this test is expected to fail.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEY_COUNT 3000
+// Tables are indexed by hash bits 7 and up, so keys that agree on these
+// bits land on the same home slot in every table of up to 4096 slots.
+#define SLOT_MASK (4095u << 7)
+#define MAX_PROBE 64
+
+static uint32 fnv_hash(const char* key, int32 length) {
+    uint32 hash = 2166136261u;
+    for (int32 i = 0; i < length; i++) {
+        hash ^= (uint8) key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+int main() {
+    init_vm();
+    // The keys are only reachable from this table, which the collector
+    // cannot see, so collection is turned off.
+    vm.next_gc = SIZE_MAX;
+
+    Table table;
+    init_table(&table);
+
+    static ObjString* keys[KEY_COUNT];
+    int32 count = 0;
+    char buffer[32];
+    for (uint32 i = 0; count < KEY_COUNT; i++) {
+        int32 length = snprintf(buffer, sizeof(buffer), "key%u", i);
+        if ((fnv_hash(buffer, length) & SLOT_MASK) != 0) {
+            continue;
+        }
+        keys[count] = copy_string(buffer, length);
+        table_set(&table, keys[count], number_val(count));
+        count++;
+    }
+
+    int32 failures = 0;
+    for (int32 i = 0; i < KEY_COUNT; i++) {
+        Value value;
+        if (!table_get(&table, keys[i], &value) || as_number(value) != i) {
+            fprintf(stderr, "Key \"%s\" was not found.\n", keys[i]->chars);
+            failures++;
+        }
+    }
+
+    int32 max_probe = table_max_probe(&table);
+    printf("%d colliding keys, %d slots, max probe %d\n", KEY_COUNT, table.capacity, max_probe);
+    if (max_probe > MAX_PROBE) {
+        fprintf(stderr, "Max probe %d is over the limit of %d.\n", max_probe, MAX_PROBE);
+        failures++;
+    }
+
+    free_table(&table);
+    free_vm();
+    return failures == 0 ? 0 : 1;
+}